@@ -16,14 +16,20 @@
  * CSC369 Assignment 1 - a1fs driver implementation.
  */
 
+// For SEEK_DATA and SEEK_HOLE
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
-// Using 2.9.x FUSE API
-#define FUSE_USE_VERSION 29
+// Using 3.x FUSE API
+#define FUSE_USE_VERSION 31
 #include <fuse.h>
 
 #include "helper.c"
@@ -31,6 +37,7 @@
 #include "fs_ctx.h"
 #include "options.h"
 #include "map.h"
+#include "util.h"
 #include <libgen.h>
 //NOTE: All path arguments are absolute paths within the a1fs file system and
 // start with a '/' that corresponds to the a1fs root directory.
@@ -60,11 +67,38 @@ static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
 	// Nothing to initialize if only printing help
 	if (opts->help) return true;
 
-	size_t size;
-	void *image = map_file(opts->img_path, A1FS_BLOCK_SIZE, &size);
-	if (!image) return false;
+	if (!fs_mount(fs, opts)) return false;
+	// Files left open when the driver was last stopped
+	fs_free_orphans(fs);
+	return true;
+}
 
-	return fs_ctx_init(fs, image, size);
+/**
+ * Negotiate the connection with the kernel (see conn_init()) and set up how
+ * long it may cache names and attributes and whether it keeps file data
+ * cached across opens, as given by the mount options.
+ *
+ * This is the FUSE init() callback; the file system itself has already been
+ * set up by a1fs_init().
+ *
+ * @param conn  connection information.
+ * @param cfg   high-level API configuration.
+ * @return      the file system context (becomes private_data).
+ */
+static void *a1fs_conn_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	fs_ctx *fs = (fs_ctx*)fuse_get_context()->private_data;
+	conn_init(fs, conn);
+
+	cfg->entry_timeout = fs->opts->entry_timeout;
+	cfg->attr_timeout = fs->opts->attr_timeout;
+	cfg->negative_timeout = fs->opts->negative_timeout;
+	cfg->kernel_cache = fs->opts->kernel_cache;
+	cfg->auto_cache = fs->opts->auto_cache;
+	// Unlinking an open file removes it right away instead of renaming it to
+	// a hidden name; the inode itself lives on until released (see a1fs_open())
+	cfg->hard_remove = 1;
+	return fs;
 }
 
 /**
@@ -75,11 +109,9 @@ static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
  */
 static void a1fs_destroy(void *ctx)
 {
-	fs_ctx *fs = (fs_ctx*)ctx;
-	if (fs->image) {
-		munmap(fs->image, fs->size);
-		fs_ctx_destroy(fs);
-	}
+	// Files still open at unmount were never released
+	if (((fs_ctx*)ctx)->image) fs_free_orphans((fs_ctx*)ctx);
+	fs_unmount((fs_ctx*)ctx);
 }
 
 /** Get file system context. */
@@ -88,6 +120,27 @@ static fs_ctx *get_fs(void)
 	return (fs_ctx*)fuse_get_context()->private_data;
 }
 
+/**
+ * Get the inode number of the file a request refers to: from its file handle
+ * if the file is open (see a1fs_open()), otherwise by looking up the path.
+ *
+ * @param fs      file system context.
+ * @param path    path to the file.
+ * @param fi      open file information; may be NULL.
+ * @param ino     pointer to the variable that receives the inode number.
+ * @param cursor  pointer to the variable that receives the extent lookup
+ *                cursor of the open file (NULL if the file isn't open).
+ * @return        0 on success; -errno on error.
+ */
+static int file_lookup(fs_ctx *fs, const char *path, struct fuse_file_info *fi,
+                       a1fs_ino_t *ino, extent_cursor **cursor)
+{
+	*cursor = ((fi != NULL) && (fi->fh != 0)) ? (extent_cursor*)(uintptr_t)fi->fh : NULL;
+	if (*cursor == NULL) return path_lookup(fs, path, ino);
+	*ino = (*cursor)->ino;
+	return 0;
+}
+
 
 /**
  * Get file system statistics.
@@ -107,34 +160,7 @@ static fs_ctx *get_fs(void)
 static int a1fs_statfs(const char *path, struct statvfs *st)
 {
 	(void)path;// unused
-	fs_ctx *fs = get_fs();
-
-	memset(st, 0, sizeof(*st));
-	st->f_bsize   = A1FS_BLOCK_SIZE;
-	st->f_frsize  = A1FS_BLOCK_SIZE;
-	//TODO: fill in the rest of required fields based on the information stored
-	// in the superblock
-	// get attributes from the struct fs
-	void *image = fs->image;
-	size_t size = fs->size;
-	struct a1fs_superblock *sp = (struct a1fs_superblock *)(image);
-
-	// set fields in statvfs *st
-	int blocks_num = 0;
-	if (size % A1FS_BLOCK_SIZE) {
-		blocks_num = size/A1FS_BLOCK_SIZE + 1;
-	} else {
-		blocks_num = size/A1FS_BLOCK_SIZE;
-	}
-	st->f_blocks  = blocks_num;
-	st->f_bfree   = blocks_num - sp->blocks_usd;
-	st->f_bavail  = blocks_num - sp->blocks_usd;
-	st->f_files   = sp->s_inodes_count;
-	st->f_ffree   = sp->s_inodes_count - sp->inodes_usd;
-	st->f_favail  = sp->s_inodes_count - sp->inodes_usd;
-	st->f_namemax = A1FS_NAME_MAX;
-
-	
+	fs_statfs(get_fs(), st);
 	return 0;
 }
 
@@ -155,219 +181,161 @@ static int a1fs_statfs(const char *path, struct statvfs *st)
  *
  * @param path  path to a file or directory.
  * @param st    pointer to the struct stat that receives the result.
+ * @param fi    open file information (NULL if not open); see file_lookup().
  * @return      0 on success; -errno on error;
  */
-static int a1fs_getattr(const char *path, struct stat *st)
+static int a1fs_getattr(const char *path, struct stat *st,
+                        struct fuse_file_info *fi)
 {	
-	if (strlen(path) >= A1FS_PATH_MAX) return -ENAMETOOLONG;
+	// An open file that has been unlinked has no path (see a1fs_open())
+	if ((path != NULL) && (strlen(path) >= A1FS_PATH_MAX)) return -ENAMETOOLONG;
 	fs_ctx *fs = get_fs();
 
 	memset(st, 0, sizeof(*st));
 
 	//TODO: lookup the inode for given path and, if it exists, fill in the
 	// required fields based on the information stored in the inode
+	a1fs_ino_t ino;
+	extent_cursor *cursor;
+	int ret = file_lookup(fs, path, fi, &ino, &cursor);
+	if (ret != 0) return ret;
 
-	// attribute from fs_ctx *fs
-	void *image = fs->image;
-	struct a1fs_superblock *sp = (struct a1fs_superblock *)(image);
+	inode_rdlock(fs, ino);
+	inode_stat(inode_at(fs, ino), st);
+	inode_unlock(fs, ino);
 
-	//check if path is valid
-	if ((path[0] != '/') && (path[0] != '.')){
-		return -ENOENT;
-	} 
+	return 0;
+}
 
-	//check if path is root
-	if (strcmp(path, "/") == 0){
-		struct a1fs_inode *root = (struct a1fs_inode *)(image + sp->s_first_inode);
 
-		st->st_mode = S_IFDIR | 0777;
-		st->st_nlink = root->links;
-		st->st_size = root->size;
-		st->st_blocks = root->size / 512;
-		st->st_mtim = root->mtime;
-		return 0;
-	} 
-	
-	// Get current file or directory attributes starting from root.
-	struct a1fs_inode *current_inode = (struct a1fs_inode *)(image + sp->s_first_inode);
-	struct a1fs_extent *cur_extent;
-	int cur_ino = 0;
-
-	// traverse the path and verify that path is valid.
-	char pathA[strlen(path)];
-    strcpy(pathA, path+1);
-    char* token = strtok(pathA, "/");
-    while (token != NULL) {
-		bool found = false;
-		// check if current path prefix is not a directory
-		if ((current_inode->mode & S_IFMT)!=S_IFDIR) {
-			return -ENOTDIR;
-		}
+/**
+ * Tell the kernel that the attributes of a directory have changed (its size
+ * and mtime change as entries come and go), so that it doesn't serve the
+ * cached ones until attr_timeout runs out.
+ *
+ * NOTE: only directories are invalidated, in both drivers (see ll_changed()
+ * in a1fs_ll.c): the kernel updates or drops the attributes of a file that it
+ * writes, truncates or fallocates itself, and owns its size and mtime under
+ * the writeback cache, so a notification per write would only add an upcall
+ * and a GETATTR on the next stat. (The high-level API also can only
+ * invalidate a path together with its cached data, and dropping the pages of
+ * a file can wait for the writeback that the request being served is part of.)
+ *
+ * @param path  path to the directory.
+ */
+static void dir_changed(const char *path)
+{
+	fuse_invalidate_path(fuse_get_context()->fuse, path);
+}
 
-		// traverse the extents in the inodes. In each extent, travese the dentry to find the component.
-		for (int j = 0; j < current_inode->extent_used; j++) {
-			cur_extent = (struct a1fs_extent *)(image + sp->s_first_data_block + current_inode->extend_pt + j * sizeof(a1fs_extent));
-
-			int entry_length = (cur_extent->count) * A1FS_BLOCK_SIZE / sizeof(a1fs_dentry);
-			for (int i = 0; i < entry_length; i++) {
-				struct a1fs_dentry *cur_entry = (struct a1fs_dentry *)(image + sp->s_first_data_block + cur_extent->start + i * sizeof(a1fs_dentry));
-				
-				if (strcmp(cur_entry->name, token) == 0) {
-					found = true;
-					// Update current file or directory attributes.
-					cur_ino = cur_entry->ino;
-					current_inode = (struct a1fs_inode *)(image + sp->s_first_inode + cur_ino * sizeof(a1fs_inode));
-					break;
-				}
-			}
-			if (found) {break;}
-		}
 
-		if (!found){
-			token = strtok(NULL, "/");
-			return (token == NULL)? -ENOENT : -ENOTDIR;
-		}
-        token = strtok(NULL, "/");
-    }
-	
-	st->st_mode   = current_inode->mode;
-	st->st_nlink  = current_inode->links;
-	st->st_size   = current_inode->size;
-	st->st_blocks = current_inode->size / 512;
-	st->st_mtim   = current_inode->mtime;
+/** Arguments of readdir_fill(). */
+typedef struct readdir_args {
+	void *buf;
+	fuse_fill_dir_t filler;
+	/** Whether to pass the attributes of the entries (readdirplus). */
+	bool plus;
 
-	return 0;
-}
+} readdir_args;
 
+/** Pass a directory entry on to the readdir() filler; see dir_iterate(). */
+static bool readdir_fill(fs_ctx *fs, struct a1fs_dentry *entry, off_t next, void *arg)
+{
+	readdir_args *args = arg;
+	if (!args->plus) {
+		return args->filler(args->buf, dentry_name(fs, entry), NULL, next, 0) == 0;
+	}
+
+	// The directory lock keeps the entry from being unlinked meanwhile
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	inode_rdlock(fs, entry->ino);
+	inode_stat(inode_at(fs, entry->ino), &st);
+	inode_unlock(fs, entry->ino);
+	return args->filler(args->buf, dentry_name(fs, entry), &st, next, FUSE_FILL_DIR_PLUS) == 0;
+}
 
 /**
  * Read a directory.
  *
- * Implements the readdir() system call. Should call filler(buf, name, NULL, 0)
+ * Implements the readdir() system call. Should call filler(buf, name, NULL, 0, 0)
  * for each directory entry. See fuse.h in libfuse source code for details.
  *
+ * With readdirplus (see conn_init()) the attributes of each entry are passed
+ * along with it, so that the kernel doesn't have to look every entry up.
+ *
+ * Each entry is passed with the position of the entry after it (see
+ * dir_iterate()), so a listing stops once the buffer is full and FUSE resumes
+ * it from there with the next call; a listing of a large directory takes time
+ * linear in its size over all the calls, and telldir()/seekdir() work. The
+ * positions stay valid while entries are removed during the listing.
+ *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a directory.
  *
- * Errors:
- *   ENOMEM  not enough memory (e.g. a filler() call failed).
+ * Errors: none
  *
  * @param path    path to the directory.
  * @param buf     buffer that receives the result.
  * @param filler  function that needs to be called for each directory entry.
- *                Pass 0 as offset (4th argument). 3rd argument can be NULL.
- * @param offset  unused.
- * @param fi      unused.
+ * @param offset  position to resume the listing from; 0 to start over.
+ * @param fi      open directory information; see a1fs_opendir().
+ * @param flags   FUSE_READDIR_PLUS to pass the attributes of the entries.
  * @return        0 on success; -errno on error.
  */
 static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                        off_t offset, struct fuse_file_info *fi)
+                        off_t offset, struct fuse_file_info *fi,
+                        enum fuse_readdir_flags flags)
 {
-	(void)offset;// unused
-	(void)fi;// unused
 	fs_ctx *fs = get_fs();
 
 	//TODO: lookup the directory inode for given path and iterate through its
 	// directory entries
-	void *image = fs->image;
-	struct a1fs_superblock *sp = (struct a1fs_superblock *)(image);
-	
-	//check if path is valid
-	if ((path[0] != '/')){
-		return -ENOENT;
-	} 
-	//check if path is root, if it is, write each entry into filler.
-	if (strcmp(path, "/") == 0){
-		struct a1fs_extent *cur_extent;
-		struct a1fs_inode *root = (struct a1fs_inode *)(image + sp->s_first_inode);
-		int entry_check = root->size/sizeof(a1fs_dentry);
-
-		for (int j = 0; j < root->extent_used; j++) {
-
-			if (entry_check == 0) {break;}
-			cur_extent = (struct a1fs_extent *)(image + sp->s_first_data_block + root->extend_pt + j * sizeof(a1fs_extent));
-
-			int entry_length = (cur_extent->count) * A1FS_BLOCK_SIZE / sizeof(a1fs_dentry);
-			for (int i = 0; i < entry_length; i++) {
-				if (entry_check == 0) {break;}
-				struct a1fs_dentry *root_dir_entry = (struct a1fs_dentry *)(image + sp->s_first_data_block + cur_extent->start + i * sizeof(a1fs_dentry));
-				if (strcmp(root_dir_entry->name, " ") == 0) {
-					continue;
-				}
-				int i = filler(buf, root_dir_entry->name, NULL, 0);
-				if (i != 0){
-					return -ENOMEM;
-				}
-				entry_check -= 1;
-			}
-		}
-		return 0;
-	} 
-
-	// Get current file or directory attributes.
-	struct a1fs_inode *current_inode = (struct a1fs_inode *)(image + sp->s_first_inode);
-	struct a1fs_extent *cur_extent;
-	int cur_ino = 0;
-
-	// traverse the path and get the inode of the last component.
-	char pathA[strlen(path)];
-    strcpy(pathA, path+1);
-    char* token = strtok(pathA, "/");
-    while (token != NULL) {
-		bool found = false;
-		// check if current path prefix is not a directory
-		if ((current_inode->mode & S_IFMT)!=S_IFDIR) {
-			return -ENOTDIR;
-		}
+	a1fs_ino_t ino;
+	extent_cursor *cursor;
+	int ret = file_lookup(fs, path, fi, &ino, &cursor);
+	if (ret != 0) return ret;
+
+	readdir_args args = {buf, filler, (flags & FUSE_READDIR_PLUS) != 0};
+	inode_rdlock(fs, ino);
+	dir_iterate(fs, inode_at(fs, ino), offset, readdir_fill, &args);
+	inode_unlock(fs, ino);
+	return 0;
+}
 
-		// traverse the extents in the inodes. In each extent, travese the dentry to find the component.
-		for (int j = 0; j < current_inode->extent_used; j++) {
-			cur_extent = (struct a1fs_extent *)(image + sp->s_first_data_block + current_inode->extend_pt + j * sizeof(a1fs_extent));
-
-			int entry_length = (cur_extent->count) * A1FS_BLOCK_SIZE / sizeof(a1fs_dentry);
-			for (int i = 0; i < entry_length; i++) {
-				struct a1fs_dentry *cur_entry = (struct a1fs_dentry *)(image + sp->s_first_data_block + cur_extent->start + i * sizeof(a1fs_dentry));
-				
-				if (strcmp(cur_entry->name, token) == 0) {
-					found = true;
-					// Update current file or directory attributes.
-					cur_ino = cur_entry->ino;
-					current_inode = (struct a1fs_inode *)(image + sp->s_first_inode + cur_ino * sizeof(a1fs_inode));
-					break;
-				}
-			}
-			if (found) {break;}
-		}
 
-		if (!found){
-			token = strtok(NULL, "/");
-			return (token != NULL)? -ENOENT : 0;
-		}
-        token = strtok(NULL, "/");
-    }
-
-	// call filler on each entry.
-	int entry_check = current_inode->size/sizeof(a1fs_dentry);
-
-	for (int j = 0; j < current_inode->extent_used; j++) {
-		if (entry_check == 0) {break;}
-		cur_extent = (struct a1fs_extent *)(image + sp->s_first_data_block + current_inode->extend_pt + j * sizeof(a1fs_extent));
-		
-		int entry_length = (cur_extent->count) * A1FS_BLOCK_SIZE / sizeof(a1fs_dentry);
-		for (int i = 0; i < entry_length; i++) {
-			if (entry_check == 0) {break;}
-			struct a1fs_dentry *cur_dentry = (struct a1fs_dentry *)(image + sp->s_first_data_block + cur_extent->start + i * sizeof(a1fs_dentry));
-			if (strcmp(cur_dentry->name, " ") == 0) {
-				continue;
-			}
-			int i = filler(buf, cur_dentry->name, NULL, 0);
-			if (i != 0){
-				return -ENOMEM;
-			}
-			entry_check -= 1;
-		}
-	}
-	return 0;
+/**
+ * Create a new inode and link it into the parent directory of "path".
+ *
+ * Shared by mkdir() and create(). The parent directory is resolved once and
+ * the new path is entered into the lookup cache.
+ *
+ * @param path   path to the new file or directory.
+ * @param mode   file mode bits (including the file type).
+ * @param links  initial link count of the new inode.
+ * @return       0 on success; -errno on error.
+ */
+static int create_node(const char *path, mode_t mode, uint32_t links)
+{
+	fs_ctx *fs = get_fs();
+
+	// get the parent inode number.
+	char pathA[PATH_MAX];
+	strcpy(pathA, path);
+	char *path_dir = dirname(pathA);
+	a1fs_ino_t parent_inode;
+	int ret = path_lookup(fs, path_dir, &parent_inode);
+	if (ret != 0) return ret;
+	inode_wrlock(fs, parent_inode);
+
+	char pathB[PATH_MAX];
+	strcpy(pathB, path);
+	a1fs_ino_t new_ino;
+	ret = node_create(fs, inode_at(fs, parent_inode), basename(pathB), mode, links, &new_ino);
+	if (ret == 0) dcache_insert(fs, path, new_ino, false);
+	inode_unlock(fs, parent_inode);
+	if (ret == 0) dir_changed(path_dir);
+	return ret;
 }
 
 
@@ -392,113 +360,9 @@ static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int a1fs_mkdir(const char *path, mode_t mode)
 {
 	mode = mode | S_IFDIR;
-	fs_ctx *fs = get_fs();
 
 	//TODO: create a directory at given path with given mode
-
-	// attribute from fs_ctx *fs
-	void *image = fs->image;
-	struct a1fs_superblock *sp = (struct a1fs_superblock *)(image);
-
-	// get the parent inode number.
-	int parent_inode;
-	get_inode(path, image, sp, &parent_inode);
-
-	/** if parent does not have extent, initalize a extent block and a extent.
-	*/
-	struct a1fs_inode *parent = (struct a1fs_inode *)(image + sp->s_first_inode + parent_inode * sizeof(a1fs_inode));
-	
-	if (parent->extent_used == 0){
-		int extent_pt_index;
-		if (set_single_bitmap(image, sp, &extent_pt_index, 0) == -1) {
-			return -ENOSPC;
-		}
-		parent->extend_pt = extent_pt_index * A1FS_BLOCK_SIZE;
-
-		int first_extent_pt;
-		if (set_single_bitmap(image, sp, &first_extent_pt, 0) == -1) {
-			return -ENOSPC;
-		}
-		struct a1fs_extent *first_extent = (image + sp->s_first_data_block + parent->extend_pt);
-		first_extent->start = first_extent_pt * A1FS_BLOCK_SIZE;
-		first_extent->count = 1;
-		memset((image + sp->s_first_data_block + first_extent->start), 0, A1FS_BLOCK_SIZE*first_extent->count);
-		parent->extent_used ++;
-	}
-
-	parent->links += 1;
-
-	/** find avaliable space in inode bitmap and update inode bitmap. */
-	int new_ino;
-	int error = set_inode_bitmap(image, sp, &new_ino);
-	//check if there is avaliable inode in the file system.
-	if (error < 0) return -ENOSPC;
-
-	/** add new a1fs_dentry to parent directory block and set its attribute. */
-	int entry_stored = parent->size / sizeof(a1fs_dentry);
-	struct a1fs_extent *cur_extent;
-	bool found = false;
-
-	for (int j = 0; j < parent->extent_used; j++) {
-		cur_extent = (struct a1fs_extent *)(image + sp->s_first_data_block + parent->extend_pt + j * sizeof(a1fs_extent));
-
-		int entry_length = (cur_extent->count) * A1FS_BLOCK_SIZE / sizeof(a1fs_dentry);
-		for (int i = 0; i < entry_length; i++) {
-			struct a1fs_dentry *cur_entry = (struct a1fs_dentry *)(image + sp->s_first_data_block + cur_extent->start + i * sizeof(a1fs_dentry));
-			if ((strcmp(cur_entry->name, " ") == 0) || (entry_stored == 0)) {
-				found = true;
-
-				char pathA[PATH_MAX]; 
-				strcpy(pathA, path);
-				char *name = basename(pathA);
-				strcpy(cur_entry->name, name);
-				cur_entry->ino = new_ino;
-				break;	
-			} 
-			entry_stored --;
-		}
-		if (found) {break;}
-	}
-
-    /**find new extent and add it to the inode*/
-	if (found == false) {
-		int extent_bk;
-		if (set_single_bitmap(image, sp, &extent_bk, 0) == -1) {
-			return -ENOSPC;
-		}
-		struct a1fs_extent *new_extent = (struct a1fs_extent *)(image + sp->s_first_data_block + parent->extend_pt + parent->extent_used * sizeof(a1fs_extent));
-		new_extent->start = extent_bk * A1FS_BLOCK_SIZE;
-		new_extent->count = 1;
-		memset((image + sp->s_first_data_block + new_extent->start), 0, A1FS_BLOCK_SIZE*new_extent->count);
-		parent->extent_used ++;
-
-		struct a1fs_dentry *new_entry = (struct a1fs_dentry *)(image + sp->s_first_data_block + new_extent->start);
-		char pathA[PATH_MAX]; 
-		strcpy(pathA, path);
-		char *name = basename(pathA);
-		strcpy(new_entry->name, name);
-		new_entry->ino = new_ino;
-	}
-
-	/** create inode and set inode attribute */
-	struct a1fs_inode *new_inode = (struct a1fs_inode *)(image + sp->s_first_inode + new_ino*sizeof(a1fs_inode));
-	new_inode->mode  = mode;
-	new_inode->links = 2;
-	new_inode->size  = 0;
-	int time_updated_or_not = clock_gettime(CLOCK_REALTIME, &new_inode->mtime);
-	if (time_updated_or_not == -1) {
-        perror("clock_gettime");
-        exit(EXIT_FAILURE);
-    }
-
-	/** update parent inode attribute */
-	parent->size += sizeof(a1fs_dentry);
-	parent->mtime = new_inode->mtime;
-
-	/** update super block*/
-	sp->inodes_usd += 1;
-
-	return 0;
+	return create_node(path, mode, 2);
 }
 
 
@@ -521,79 +385,135 @@ static int a1fs_rmdir(const char *path)
 	fs_ctx *fs = get_fs();
 
 	//TODO: remove the directory at given path (only if it's empty)
-	// attribute from fs_ctx *fs
-	void *image = fs->image;
-	struct a1fs_superblock *sp = (struct a1fs_superblock *)(image);
 
 	// get the inode number of the target and its parent directory
+	a1fs_ino_t target_inode;
+	int ret = path_lookup(fs, path, &target_inode);
+	if (ret != 0) return ret;
+
 	char pathA[PATH_MAX]; 
 	strcpy(pathA, path);
 	char *path_dir = dirname(pathA);
-	int parent_inode;
-	get_inode(path_dir, image, sp, &parent_inode);
-	int target_inode;
-	get_inode(path, image, sp, &target_inode);
-
-	/** set inode bitmap to 0 for target inode */
-	struct a1fs_inode *target_dir = (struct a1fs_inode *)(image + sp->s_first_inode + target_inode * sizeof(a1fs_inode));
+	a1fs_ino_t parent_inode;
+	ret = path_lookup(fs, path_dir, &parent_inode);
+	if (ret != 0) return ret;
+
+	// Parent before child; the child lock waits out anyone still reading it
+	inode_wrlock(fs, parent_inode);
+	inode_wrlock(fs, target_inode);
+	struct a1fs_inode *target_dir = inode_at(fs, target_inode);
 	if (target_dir->size != 0) {
+		inode_unlock(fs, target_inode);
+		inode_unlock(fs, parent_inode);
 		return -ENOTEMPTY;
 	}
-	rm_inode_bitmap(image, sp, target_inode);
-
-	/** find target a1fs_dentry in parent entry list and set ino to -1. Update parent inode attributes */
-	struct a1fs_inode *parent = (struct a1fs_inode *)(image + sp->s_first_inode + parent_inode * sizeof(a1fs_inode));
-	parent->links -= 1;
-	parent->size -= sizeof(a1fs_dentry);
-	int time_updated_or_not = clock_gettime(CLOCK_REALTIME, &parent->mtime);
-	if (time_updated_or_not == -1) {
-        perror("clock_gettime");
-        exit(EXIT_FAILURE);
-    }
-
-
-	struct a1fs_extent *cur_extent;
-	for (int j = 0; j < parent->extent_used; j++) {
-		cur_extent = (struct a1fs_extent *)(image + sp->s_first_data_block + parent->extend_pt + j * sizeof(a1fs_extent));
-
-		int entry_length = (cur_extent->count) * A1FS_BLOCK_SIZE / sizeof(a1fs_dentry);
-		for (int i = 0; i < entry_length; i++) {
-			struct a1fs_dentry *cur_entry = (struct a1fs_dentry *)(image + sp->s_first_data_block + cur_extent->start + i * sizeof(a1fs_dentry));
-			
-			if (cur_entry->ino == (unsigned int) target_inode) {
-				strcpy(cur_entry->name, " ");
-				(cur_entry->name)[1] = '\0';
-				cur_entry->ino = 0;
-				break;
-			}
-		}
 
-		// check extent size. if size == 0, delete the extent
-		int sum = 0;
-		dentry_sum(image, sp, cur_extent, &sum);
-		if (sum == 0) {
-			int rm_index = cur_extent->start/A1FS_BLOCK_SIZE;
-			rm_single_bitmap(image, sp, rm_index,  0);
-			swap_extent(image, sp, cur_extent, parent);
-			parent->extent_used -- ;
-		}
+	/** remove target a1fs_dentry from parent entry list, then free the target */
+	char pathB[PATH_MAX];
+	strcpy(pathB, path);
+	ret = node_unlink(fs, parent_inode, basename(pathB), target_dir);
+	if (ret == 0) {
+		dcache_invalidate(fs, path);
+		// An open directory lives on (empty) until its last handle is released
+		if (fs->open_count[target_inode] == 0) inode_free(fs, target_inode);
 	}
 
-	//check size of parent directory. and update data bitmap is necessary.
-	if (parent->extent_used == 0) {
-		// free extent block pointer
-		int index = parent->extend_pt / A1FS_BLOCK_SIZE;
-		rm_single_bitmap(image, sp, index,  0);
-	}
+	inode_unlock(fs, target_inode);
+	inode_unlock(fs, parent_inode);
+	if (ret == 0) dir_changed(path_dir);
+	return ret;
+}
 
 
-	/** update super blcok*/
-	sp->inodes_usd -= 1;
+/**
+ * Open a file.
+ *
+ * Implements the open() system call. The file is looked up once here; the file
+ * handle keeps its inode number and an extent lookup cursor of its own, so
+ * that reads and writes through it neither walk the path nor start the extent
+ * lookup over.
+ *
+ * The inode can't go away while the file is open: the open handles of each
+ * inode are counted, and unlinking an open file (which FUSE passes on right
+ * away; see a1fs_conn_init()) only removes its name. The inode is freed when
+ * the last handle is released. Requests through the handle of an unlinked
+ * file come with a NULL path, which file_lookup() never needs.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *
+ * @param path  path to the file to open.
+ * @param fi    open file information; receives the file handle.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_open(const char *path, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs();
+
+	a1fs_ino_t ino;
+	int ret = path_lookup(fs, path, &ino);
+	if (ret != 0) return ret;
+
+	extent_cursor *cursor = cursor_new(ino);
+	if (cursor == NULL) return -ENOMEM;
+	inode_wrlock(fs, ino);
+	fs->open_count[ino]++;
+	inode_unlock(fs, ino);
+	fi->fh = (uintptr_t)cursor;
+	return 0;
+}
 
+/**
+ * Release an open file.
+ *
+ * Called when the last file descriptor of an open file (or directory; see
+ * a1fs_opendir()) is closed; frees the file handle set up by a1fs_open(), and
+ * the file itself if it has been unlinked and this was its last handle.
+ *
+ * @param path  path to the file; unused.
+ * @param fi    open file information.
+ * @return      0.
+ */
+static int a1fs_release(const char *path, struct fuse_file_info *fi)
+{
+	(void)path;// unused
+	fs_ctx *fs = get_fs();
+	extent_cursor *cursor = (extent_cursor*)(uintptr_t)fi->fh;
+	a1fs_ino_t ino = cursor->ino;
+
+	inode_wrlock(fs, ino);
+	if (--fs->open_count[ino] == 0) {
+		if (inode_at(fs, ino)->links == 0) {
+			inode_free(fs, ino);
+		} else if (S_ISDIR(inode_at(fs, ino)->mode)) {
+			dir_tidy(fs, ino);
+		}
+	}
+	inode_unlock(fs, ino);
 
+	free(cursor);
+	fi->fh = 0;
 	return 0;
 }
 
+/**
+ * Open a directory.
+ *
+ * Same as a1fs_open(): the handle keeps the inode number, so that a listing
+ * goes on after the directory is removed, and the handles are counted, so that
+ * the directory isn't compacted in the middle of a listing (see dir_tidy()).
+ * a1fs_release() releases the handle; the last one compacts the directory if
+ * it is due.
+ *
+ * @param path  path to the directory to open.
+ * @param fi    open directory information; receives the handle.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_opendir(const char *path, struct fuse_file_info *fi)
+{
+	return a1fs_open(path, fi);
+}
+
 
 /**
  * Create a file.
@@ -611,119 +531,17 @@ static int a1fs_rmdir(const char *path)
  *
  * @param path  path to the file to create.
  * @param mode  file mode bits.
- * @param fi    unused.
+ * @param fi    open file information; receives the file handle.
  * @return      0 on success; -errno on error.
  */
 static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-	(void)fi;// unused
 	assert(S_ISREG(mode));
-	fs_ctx *fs = get_fs();
 
 	//TODO: create a file at given path with given mode
-	// attribute from fs_ctx *fs
-	void *image = fs->image;
-	struct a1fs_superblock *sp = (struct a1fs_superblock *)(image);
-
-	int parent_inode;
-	get_inode(path, image, sp, &parent_inode);
-
-	/** currently assuming directory is small, which only uses first extent and does not 
-	 * use all the first extent of the inode. modify later
-	*/
-	struct a1fs_inode *parent = (struct a1fs_inode *)(image + sp->s_first_inode + parent_inode * sizeof(a1fs_inode));
-	
-    /** assume only use one extent */
-	if (parent->extent_used == 0){
-		int extent_pt_index;
-		if (set_single_bitmap(image, sp, &extent_pt_index, 0) == -1) {
-			return -ENOSPC;
-		}
-		parent->extend_pt = extent_pt_index * A1FS_BLOCK_SIZE;
-
-		int first_extent_pt;
-		if (set_single_bitmap(image, sp, &first_extent_pt, 0) == -1) {
-			return -ENOSPC;
-		}
-		struct a1fs_extent *first_extent = (image + sp->s_first_data_block + parent->extend_pt);
-		first_extent->start = first_extent_pt * A1FS_BLOCK_SIZE;
-		first_extent->count = 1;
-		memset((image + sp->s_first_data_block + first_extent->start), 0, A1FS_BLOCK_SIZE*first_extent->count);
-		parent->extent_used ++;
-	}
-
-
-	/** find avaliable space in inode bitmap and update inode bitmap. */
-	int new_ino;
-	int error = set_inode_bitmap(image, sp, &new_ino);
-	//check if there is avaliable inode in the file system.
-	if (error < 0) return -ENOSPC;
-
-	/** add new a1fs_dentry to parent directory block and set its attribute. */
-	int entry_stored = parent->size / sizeof(a1fs_dentry);
-	struct a1fs_extent *cur_extent;
-	bool found = false;
-
-	for (int j = 0; j < parent->extent_used; j++) {
-		cur_extent = (struct a1fs_extent *)(image + sp->s_first_data_block + parent->extend_pt + j * sizeof(a1fs_extent));
-
-		int entry_length = (cur_extent->count) * A1FS_BLOCK_SIZE / sizeof(a1fs_dentry);
-		for (int i = 0; i < entry_length; i++) {
-			struct a1fs_dentry *cur_entry = (struct a1fs_dentry *)(image + sp->s_first_data_block + cur_extent->start + i * sizeof(a1fs_dentry));
-			if ((strcmp(cur_entry->name, " ") == 0) || (entry_stored == 0)) {
-				found = true;
-
-				char pathA[PATH_MAX]; 
-				strcpy(pathA, path);
-				char *name = basename(pathA);
-				strcpy(cur_entry->name, name);
-				cur_entry->ino = new_ino;
-				break;	
-			} 
-			entry_stored --;
-		}
-		if (found) {break;}
-	}
-
-
-	if (found == false) {
-		int extent_bk;
-		if (set_single_bitmap(image, sp, &extent_bk, 0) == -1) {
-			return -ENOSPC;
-		}
-		struct a1fs_extent *new_extent = (struct a1fs_extent *)(image + sp->s_first_data_block + parent->extend_pt + parent->extent_used * sizeof(a1fs_extent));
-		new_extent->start = extent_bk * A1FS_BLOCK_SIZE;
-		new_extent->count = 1;
-		memset((image + sp->s_first_data_block + new_extent->start), 0, A1FS_BLOCK_SIZE*new_extent->count);
-		parent->extent_used ++;
-
-		struct a1fs_dentry *new_entry = (struct a1fs_dentry *)(image + sp->s_first_data_block + new_extent->start);
-		char pathA[PATH_MAX]; 
-		strcpy(pathA, path);
-		char *name = basename(pathA);
-		strcpy(new_entry->name, name);
-		new_entry->ino = new_ino;
-	}
-
-	/** create inode and set inode attribute */
-	struct a1fs_inode *new_inode = (struct a1fs_inode *)(image + sp->s_first_inode + new_ino*sizeof(a1fs_inode));
-	new_inode->mode  = mode;
-	new_inode->links = 1;
-	new_inode->size  = 0;
-	int time_updated_or_not = clock_gettime(CLOCK_REALTIME, &new_inode->mtime);
-	if (time_updated_or_not == -1) {
-        perror("clock_gettime");
-        exit(EXIT_FAILURE);
-    }
-
-	/** update parent inode attribute */
-	parent->size += sizeof(a1fs_dentry);
-	parent->mtime = new_inode->mtime;
-
-	/** update super block*/
-	sp->inodes_usd += 1;
-
-	return 0;
+	int ret = create_node(path, mode, 1);
+	if (ret != 0) return ret;
+	return a1fs_open(path, fi);
 }
 
 
@@ -745,78 +563,37 @@ static int a1fs_unlink(const char *path)
 	fs_ctx *fs = get_fs();
 
 	//TODO: remove the file at given path
-	
-	/** 
-	 * assume the file is empty. modify later.
-	*/
-	// attribute from fs_ctx *fs
-	void *image = fs->image;
-	struct a1fs_superblock *sp = (struct a1fs_superblock *)(image);
 
 	// get the inode number of the target and its parent directory
+	a1fs_ino_t target_inode_index;
+	int ret = path_lookup(fs, path, &target_inode_index);
+	if (ret != 0) return ret;
+
 	char pathA[PATH_MAX]; 
 	strcpy(pathA, path);
 	char *path_dir = dirname(pathA);
-	int parent_inode_index;
-	get_inode(path_dir, image, sp, &parent_inode_index);
-	int target_inode_index;
-	get_inode(path, image, sp, &target_inode_index);
-
-	/** set inode bitmap and data bitmap to 0 for target inode */
-	struct a1fs_inode *target_inode = (struct a1fs_inode *)(image + sp->s_first_inode + target_inode_index * sizeof(a1fs_inode));
-	rm_inode_bitmap(image, sp, target_inode_index);
-	rm_target(image, sp, target_inode);
-
-	/** find target a1fs_dentry in parent entry list and set ino to 0. Update parent inode attributes */
-	struct a1fs_inode *parent = (struct a1fs_inode *)(image + sp->s_first_inode + parent_inode_index * sizeof(a1fs_inode));
-	parent->links -= 1;
-	parent->size -= sizeof(a1fs_dentry);
-	int time_updated_or_not = clock_gettime(CLOCK_REALTIME, &parent->mtime);
-	if (time_updated_or_not == -1) {
-        perror("clock_gettime");
-        exit(EXIT_FAILURE);
-    }
-
-
-
-	struct a1fs_extent *cur_extent;
-	for (int j = 0; j < parent->extent_used; j++) {
-		cur_extent = (struct a1fs_extent *)(image + sp->s_first_data_block + parent->extend_pt + j * sizeof(a1fs_extent));
-
-		int entry_length = (cur_extent->count) * A1FS_BLOCK_SIZE / sizeof(a1fs_dentry);
-		for (int i = 0; i < entry_length; i++) {
-			struct a1fs_dentry *cur_entry = (struct a1fs_dentry *)(image + sp->s_first_data_block + cur_extent->start + i * sizeof(a1fs_dentry));
-			
-			if (cur_entry->ino == (unsigned int)target_inode_index) {
-				strcpy(cur_entry->name, " ");
-				(cur_entry->name)[1] = '\0';
-				cur_entry->ino = 0;
-				break;
-			}
-		}
-		// check extent size. if size == 0, delete the extent
-		int sum = 0;
-		dentry_sum(image, sp, cur_extent, &sum);
-		if (sum == 0) {
-			int rm_index = cur_extent->start/A1FS_BLOCK_SIZE;
-			rm_single_bitmap(image, sp, rm_index,  0);
-			swap_extent(image, sp, cur_extent, parent);
-			parent->extent_used -- ;
-		}
+	a1fs_ino_t parent_inode_index;
+	ret = path_lookup(fs, path_dir, &parent_inode_index);
+	if (ret != 0) return ret;
+
+	// Parent before child; the child lock waits out anyone still using it
+	inode_wrlock(fs, parent_inode_index);
+	inode_wrlock(fs, target_inode_index);
+
+	/** remove target a1fs_dentry from parent entry list, then free its blocks and the inode */
+	char pathB[PATH_MAX];
+	strcpy(pathB, path);
+	ret = node_unlink(fs, parent_inode_index, basename(pathB), inode_at(fs, target_inode_index));
+	if (ret == 0) {
+		dcache_invalidate(fs, path);
+		// An open file lives on until its last handle is released
+		if (fs->open_count[target_inode_index] == 0) inode_free(fs, target_inode_index);
 	}
 
-	
-	//check size of parent directory. and update data bitmap is necessary.
-	if (parent->extent_used == 0) {
-		// free extent block pointer
-		int index = parent->extend_pt / A1FS_BLOCK_SIZE;
-		rm_single_bitmap(image, sp, index,  0);
-	}
-
-	/** update super blcok*/
-	sp->inodes_usd -= 1;
-
-	return 0;
+	inode_unlock(fs, target_inode_index);
+	inode_unlock(fs, parent_inode_index);
+	if (ret == 0) dir_changed(path_dir);
+	return ret;
 }
 
 
@@ -834,44 +611,38 @@ static int a1fs_unlink(const char *path)
  *
  * @param path   path to the file or directory.
  * @param times  timestamps array. See "man 2 utimensat" for details.
+ * @param fi     open file information (NULL if not open); see file_lookup().
  * @return       0 on success; -errno on failure.
  */
-static int a1fs_utimens(const char *path, const struct timespec times[2])
+static int a1fs_utimens(const char *path, const struct timespec times[2],
+                        struct fuse_file_info *fi)
 {
 	fs_ctx *fs = get_fs();
 
 	//TODO: update the modification timestamp (mtime) in the inode for given
 	// path with either the time passed as argument or the current time,
 	// according to the utimensat man page
-	void *image = fs->image;
-	struct a1fs_superblock *sp = (struct a1fs_superblock *)(image);
 	// find the inode number that needs to be updated time
-	int target_inode_index;
-	get_inode(path, image, sp, &target_inode_index);
-
-	char pathA[PATH_MAX]; 
-	strcpy(pathA, path);
-	char *path_dir = dirname(pathA);
-	
-	int parent_inode_index;
-	get_inode(path_dir, image, sp, &parent_inode_index);
+	a1fs_ino_t target_inode_index;
+	extent_cursor *cursor;
+	int ret = file_lookup(fs, path, fi, &target_inode_index, &cursor);
+	if (ret != 0) return ret;
+	struct a1fs_inode *target_inode = inode_at(fs, target_inode_index);
 
-	struct a1fs_inode *target_inode = (struct a1fs_inode *)(image + sp->s_first_inode + target_inode_index * sizeof(a1fs_inode));
-	struct a1fs_inode *parent_inode = (struct a1fs_inode *)(image + sp->s_first_inode + parent_inode_index * sizeof(a1fs_inode));
 	// check if the time arguement has content
-	if (times != NULL){
-		target_inode->mtime = times[1];
-		parent_inode->mtime = times[1];
+	if ((times != NULL) && (times[1].tv_nsec == UTIME_OMIT)) {
 		return 0;
 	}
-	// else update the inode with current time
-	int time_updated_or_not = clock_gettime(CLOCK_REALTIME, &target_inode->mtime);
-	int time_updated_or_not_2 = clock_gettime(CLOCK_REALTIME, &parent_inode->mtime);
-	if (time_updated_or_not == -1 || time_updated_or_not_2 == -1) {
-        perror("clock_gettime");
-		return -ENOSYS;
+	inode_wrlock(fs, target_inode_index);
+	if ((times != NULL) && (times[1].tv_nsec != UTIME_NOW)) {
+		target_inode->mtime = times[1];
+	} else if (clock_gettime(CLOCK_REALTIME, &target_inode->mtime) == -1) {
+		// else update the inode with current time
+		perror("clock_gettime");
+		ret = -ENOSYS;
 	}
-	return 0;
+	inode_unlock(fs, target_inode_index);
+	return ret;
 }
 
 
@@ -891,103 +662,30 @@ static int a1fs_utimens(const char *path, const struct timespec times[2])
  *
  * @param path  path to the file to set the size.
  * @param size  new file size in bytes.
+ * @param fi    open file information (NULL if not open); see file_lookup().
  * @return      0 on success; -errno on error.
  */
-static int a1fs_truncate(const char *path, off_t size)
+static int a1fs_truncate(const char *path, off_t size,
+                         struct fuse_file_info *fi)
 {
 	fs_ctx *fs = get_fs();
 
 	//TODO: set new file size, possibly "zeroing out" the uninitialized range
-	void *image = fs->image;
-	struct a1fs_superblock *sp = (struct a1fs_superblock *)(image);
-
-	int target_inode_index;
-	get_inode(path, image, sp, &target_inode_index);
-	struct a1fs_inode *target_inode = (struct a1fs_inode *)(image + sp->s_first_inode + target_inode_index * sizeof(a1fs_inode));
-
-	if (size == 0) {
-		return a1fs_unlink(path);
-	}
-
-	int target_blocks = (((target_inode->size)%A1FS_BLOCK_SIZE)==0) ? target_inode->size/A1FS_BLOCK_SIZE : target_inode->size/A1FS_BLOCK_SIZE + 1;
-	int size_blocks = ((size%A1FS_BLOCK_SIZE)==0) ? size/A1FS_BLOCK_SIZE : size/A1FS_BLOCK_SIZE + 1;
-	int old_size = target_inode->size;
-
-
-	if (target_blocks == size_blocks) {
-		return 0;
+	a1fs_ino_t target_inode_index;
+	extent_cursor *cursor;
+	int ret = file_lookup(fs, path, fi, &target_inode_index, &cursor);
+	if (ret != 0) return ret;
+	struct a1fs_inode *target_inode = inode_at(fs, target_inode_index);
+
+	inode_wrlock(fs, target_inode_index);
+	ret = file_resize(fs, target_inode_index, size);
+
+	if ((ret == 0) && (clock_gettime(CLOCK_REALTIME, &target_inode->mtime) == -1)) {
+		perror("clock_gettime");
+		ret = -ENOSYS;
 	}
-
-	if (target_blocks < size_blocks) {
-
-		if (target_inode->extent_used == 0){
-			int extent_pt_index;
-			if (set_single_bitmap(image, sp, &extent_pt_index, 0) == -1) {
-				return -ENOSPC;
-			}
-			target_inode->extend_pt = extent_pt_index * A1FS_BLOCK_SIZE;
-		}
-
-		int blocks_required = size_blocks - target_blocks;
-
-		int extent_count;
-		struct a1fs_extent *free_extents = find_free_extents(image, sp, &extent_count);
-		if (sum_extents(free_extents, extent_count) < blocks_required) {return -ENOSPC;}
-		sort_extents(free_extents, extent_count);
-
-		int extent_index = 0;
-
-		while (blocks_required != 0) {
-			allocate_extent(image, sp, blocks_required, free_extents[extent_index], target_inode, &blocks_required);
-			struct a1fs_extent *last_extent = (struct a1fs_extent *)(image + sp->s_first_data_block + target_inode->extend_pt + ((target_inode->extent_used)-1) * sizeof(a1fs_extent));
-			set_multiple_data_bitmap(image, sp, *last_extent);
-			extent_index += 1;
-		}
-		free(free_extents);
-		target_inode->size = size;
-
-
-		int ext_index;
-		int byte_index;
-		find_extent(image, sp, target_inode, old_size-1, &ext_index, &byte_index);
-		struct a1fs_extent *target_extent = (struct a1fs_extent *)(image + sp->s_first_data_block + target_inode->extend_pt + ext_index*sizeof(a1fs_extent));
-		int residue = target_extent->count * A1FS_BLOCK_SIZE - (byte_index+1);
-
-		if (residue > 0) {
-			memset((image + sp->s_first_data_block + target_extent->start + byte_index), 0, residue);
-		} else if (residue < 0) {
-			return -errno;
-		} 
-
-	} else {
-		// check if we need to delete a complete block
-		struct a1fs_extent *target_inode_extent = (struct a1fs_extent *)(image + sp->s_first_data_block + target_inode->extend_pt);
-		int data_remain = (target_inode->size) % A1FS_BLOCK_SIZE;
-		int data_to_be_deleted = target_inode->size - size;
-		if (data_to_be_deleted < data_remain){
-			target_inode->size = size;
-		}
-		if (data_to_be_deleted >= data_remain){
-			target_inode->size = size;
-			//update databit map and extent
-			int data_remain_2 = size % A1FS_BLOCK_SIZE;
-			int full_blocks = size / A1FS_BLOCK_SIZE;
-			struct a1fs_extent new_extent;
-			new_extent.start = target_inode_extent->start;
-			if (data_remain_2 != 0){
-				new_extent.count = full_blocks + 1;
-			} else {
-				new_extent.count = full_blocks;
-			}
-			// remove the original data block bitmap
-			rm_multiple_data_bitmap(image, sp, *target_inode_extent);
-			// set new data block bitmap
-			set_multiple_data_bitmap(image, sp, new_extent);
-			return 0;
-		}
-	}
-
-	return 0;
+	inode_unlock(fs, target_inode_index);
+	return ret;
 }
 
 
@@ -996,8 +694,9 @@ static int a1fs_truncate(const char *path, off_t size)
  *
  * Implements the pread() system call. Must return exactly the number of bytes
  * requested except on EOF (end of file). Reads from file ranges that have not
- * been written to must return ranges filled with zeros. You can assume that the
- * byte range from offset to offset + size is contained within a single block.
+ * been written to must return ranges filled with zeros. The byte range from
+ * offset to offset + size may span any number of blocks and extents (up to the
+ * max_read mount option).
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
@@ -1008,59 +707,25 @@ static int a1fs_truncate(const char *path, off_t size)
  * @param buf     pointer to the buffer that receives the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to read from.
- * @param fi      unused.
+ * @param fi      open file information; see file_lookup().
  * @return        number of bytes read on success; 0 if offset is beyond EOF;
  *                -errno on error.
  */
 static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
                      struct fuse_file_info *fi)
 {
-	(void)fi;// unused
 	fs_ctx *fs = get_fs();
 
 	//TODO: read data from the file at given offset into the buffer
-	// attribute from fs_ctx *fs
-	void *image = fs->image;
-	struct a1fs_superblock *sp = (struct a1fs_superblock *)(image);
-
-	int target_inode_index;
-	get_inode(path, image, sp, &target_inode_index);
-
-	/** create target inode. Assume file only have one block of data. 
-	 * which means if offset >= 4096, then assume it is beyond end of file.
-	 * Modify later.
-	*/
-	struct a1fs_inode *target_inode = (struct a1fs_inode *)(image + sp->s_first_inode + target_inode_index * sizeof(a1fs_inode));
-	if (offset >= (unsigned int)target_inode->size){
-		return 0;
-	}
-
-	struct a1fs_extent *first_extent = (struct a1fs_extent *)(image + sp->s_first_data_block + target_inode->extend_pt);
-	int data_start = first_extent->start;
-
-	size_t remain =  A1FS_BLOCK_SIZE - (offset % A1FS_BLOCK_SIZE);
-	if (remain <= size){
-		if (target_inode->size >= offset + size){
-			memcpy(buf, (image + sp->s_first_data_block + data_start + offset), remain);
-		}
-		//if (target_inode->size < offset + size)
-		else {
-			size_t data_not_zero = target_inode->size - offset;
-			memcpy(buf, (image + sp->s_first_data_block + data_start + offset), data_not_zero);
-			// memset(buf + data_not_zero, 0, remain - target_inode->size % A1FS_BLOCK_SIZE);
-		}
-		
-	} else {
-		if (target_inode->size >= offset + size){
-			memcpy(buf, (image + sp->s_first_data_block + data_start + offset), size); 
-		} else {
-			size_t data_not_zero = target_inode->size - offset;
-			memcpy(buf, (image + sp->s_first_data_block + data_start + offset), data_not_zero);
-			// size_t data_to_be_zero = offset + size - target_inode->size;
-			// memset(buf + data_not_zero, 0, data_to_be_zero);
-		}
-	}
-	return size;
+	a1fs_ino_t target_inode_index;
+	extent_cursor *cursor;
+	int ret = file_lookup(fs, path, fi, &target_inode_index, &cursor);
+	if (ret != 0) return ret;
+
+	inode_rdlock(fs, target_inode_index);
+	size_t done = file_read(fs, target_inode_index, cursor, buf, size, offset);
+	inode_unlock(fs, target_inode_index);
+	return done;
 }
 
 
@@ -1070,8 +735,9 @@ static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
  * Implements the pwrite() system call. Must return exactly the number of bytes
  * requested except on error. If the offset is beyond EOF (end of file), the
  * file must be extended. If the write creates a "hole" of uninitialized data,
- * the new uninitialized range must filled with zeros. You can assume that the
- * byte range from offset to offset + size is contained within a single block.
+ * the new uninitialized range must filled with zeros. The byte range from
+ * offset to offset + size may span any number of blocks and extents (up to the
+ * max_write mount option).
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
@@ -1084,72 +750,296 @@ static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
  * @param buf     pointer to the buffer containing the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to write to.
- * @param fi      unused.
+ * @param fi      open file information; see file_lookup().
  * @return        number of bytes written on success; -errno on error.
  */
 static int a1fs_write(const char *path, const char *buf, size_t size,
                       off_t offset, struct fuse_file_info *fi)
 {
-	(void)fi;// unused
 	fs_ctx *fs = get_fs();
 
 	//TODO: write data from the buffer into the file at given offset, possibly
 	// "zeroing out" the uninitialized range
-		
-	void *image = fs->image;
-	struct a1fs_superblock *sp = (struct a1fs_superblock *)(image);
+	a1fs_ino_t target_inode_index;
+	extent_cursor *cursor;
+	int ret = file_lookup(fs, path, fi, &target_inode_index, &cursor);
+	if (ret != 0) return ret;
+
+	inode_wrlock(fs, target_inode_index);
+	ret = file_write(fs, target_inode_index, cursor, buf, size, offset);
+	inode_unlock(fs, target_inode_index);
+	return ret;
+}
 
-	int target_inode;
-	get_inode(path, image, sp, &target_inode);
 
-	/** create target inode. Assume file only have one extent of data. 
-	 * Modify later.
-	*/
-	struct a1fs_inode *target = (struct a1fs_inode *)(image + sp->s_first_inode + target_inode * sizeof(a1fs_inode));
-	int new_size = size + offset;
-	// calculate target data block size and the new datablock size after offset
-	int target_blocks = (((target->size)%A1FS_BLOCK_SIZE)==0) ? target->size/A1FS_BLOCK_SIZE : target->size/A1FS_BLOCK_SIZE + 1;
-	int size_blocks = ((new_size%A1FS_BLOCK_SIZE)==0) ? new_size/A1FS_BLOCK_SIZE : new_size/A1FS_BLOCK_SIZE + 1;
+/**
+ * Read data from a file without copying it.
+ *
+ * Same as a1fs_read(), but instead of copying the data into a buffer, returns
+ * a vector of buffers that refer to the ranges of the image file that hold it,
+ * one per extent, so that FUSE can splice them straight into the kernel.
+ *
+ * NOTE: FUSE frees the memory pointers of the returned buffers, so they can't
+ * point into the image mapping; they refer to the image file descriptor. The
+ * mapping is shared, so the file always has the current data. Only used in a
+ * single-threaded mount; see main().
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *
+ * @param path    path to the file to read from.
+ * @param bufp    pointer to the variable that receives the buffer vector.
+ * @param size    number of bytes requested.
+ * @param offset  offset from the beginning of the file to read from.
+ * @param fi      open file information; see file_lookup().
+ * @return        0 on success; -errno on error.
+ */
+static int a1fs_read_buf(const char *path, struct fuse_bufvec **bufp,
+                         size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs();
 
+	a1fs_ino_t target_inode_index;
+	extent_cursor *cursor;
+	int ret = file_lookup(fs, path, fi, &target_inode_index, &cursor);
+	if (ret != 0) return ret;
+
+	inode_rdlock(fs, target_inode_index);
+	struct a1fs_inode *target_inode = inode_at(fs, target_inode_index);
+	if ((uint64_t)offset >= target_inode->size) {
+		size = 0;
+	} else if (size > target_inode->size - offset) {
+		size = target_inode->size - offset;
+	}
 
-	if (target_blocks < size_blocks) {
-		a1fs_truncate(path, new_size);
+	// Each extent is at least a block long, so this many buffers are enough
+	size_t max_bufs = size / A1FS_BLOCK_SIZE + 2;
+	struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) + (max_bufs - 1) * sizeof(struct fuse_buf));
+	if (bufv == NULL) {
+		inode_unlock(fs, target_inode_index);
+		return -ENOMEM;
 	}
+	*bufv = FUSE_BUFVEC_INIT(0);
+
+	size_t done = 0;
+	bufv->count = 0;
+	while (done < size) {
+		size_t n;
+		void *data = file_data(fs, target_inode_index, cursor, offset + done, &n);
+		if (n > size - done) n = size - done;
+
+		struct fuse_buf *b = &bufv->buf[bufv->count++];
+		b->size = n;
+		if (data != NULL) {
+			b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			b->mem = NULL;
+			b->fd = fs->image_fd;
+			b->pos = data - fs->image;
+		} else {
+			// A hole has nothing to refer to; FUSE frees the zeroed memory
+			b->flags = 0;
+			b->mem = calloc(1, n);
+			if (b->mem == NULL) {
+				bufv->count--;
+				for (size_t i = 0; i < bufv->count; i++) free(bufv->buf[i].mem);
+				free(bufv);
+				inode_unlock(fs, target_inode_index);
+				return -ENOMEM;
+			}
+		}
+		done += n;
+	}
+	if (bufv->count == 0) bufv->count = 1;// empty buffer at EOF
+	inode_unlock(fs, target_inode_index);
 
-	int extent_index1;
-	int byte_index1;
-	find_extent(image, sp, target, offset, &extent_index1, &byte_index1);
+	*bufp = bufv;
+	return 0;
+}
 
-	struct a1fs_extent *offset_extent = (struct a1fs_extent *)(image + sp->s_first_data_block + target->extend_pt + extent_index1*sizeof(a1fs_extent));
-	int residue = offset_extent->count * A1FS_BLOCK_SIZE - (byte_index1+1);
-	if ((unsigned int)residue < (unsigned int)size) {
-		int leftover = size - residue;
-		memcpy((image + sp->s_first_data_block + offset_extent->start + offset), buf, residue);
 
-		struct a1fs_extent *offset_extent2 = (struct a1fs_extent *)(image + sp->s_first_data_block + target->extend_pt + (extent_index1+1)*sizeof(a1fs_extent));
-		memcpy((image + sp->s_first_data_block + offset_extent2->start), buf+residue, leftover);
+/**
+ * Write data to a file from a buffer vector.
+ *
+ * Same as a1fs_write(), but the data comes in a buffer vector that may refer
+ * to a pipe; it is moved straight into the extents in the image mapping
+ * without going through an intermediate buffer. If the pipe runs dry early,
+ * the write is short and the file only grows as far as the data.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *   ENOSPC  not enough free space in the file system.
+ *
+ * @param path    path to the file to write to.
+ * @param buf     buffer vector with the data.
+ * @param offset  offset from the beginning of the file to write to.
+ * @param fi      open file information; see file_lookup().
+ * @return        number of bytes written on success; -errno on error.
+ */
+static int a1fs_write_buf(const char *path, struct fuse_bufvec *buf,
+                          off_t offset, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs();
+
+	a1fs_ino_t target_inode_index;
+	extent_cursor *cursor;
+	int ret = file_lookup(fs, path, fi, &target_inode_index, &cursor);
+	if (ret != 0) return ret;
+	struct a1fs_inode *target_inode = inode_at(fs, target_inode_index);
+	size_t size = fuse_buf_size(buf);
+	if (size == 0) return 0;
+
+	// Data from a pipe may run out before the end of the range, so the new
+	// blocks can't be left unzeroed for the copy to overwrite
+	bool from_fd = false;
+	for (size_t i = buf->idx; i < buf->count; i++) {
+		if (buf->buf[i].flags & FUSE_BUF_IS_FD) from_fd = true;
+	}
+
+	inode_wrlock(fs, target_inode_index);
+	uint64_t old_size = target_inode->size;
+	uint64_t avail;
+	ret = file_write_begin(fs, target_inode_index, offset, size, from_fd, &avail);
+	if (ret != 0) goto end;
+	size = avail;
+
+	size_t done = 0;
+	while (done < size) {
+		size_t n;
+		void *data = file_data(fs, target_inode_index, cursor, offset + done, &n);
+		if (data == NULL) {
+			ret = -EIO;
+			break;
+		}
+		if (n > size - done) n = size - done;
+
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(n);
+		dst.buf[0].mem = data;
+		ssize_t copied = fuse_buf_copy(&dst, buf, 0);
+		if (copied <= 0) {
+			ret = copied;
+			break;
+		}
+		done += copied;
 	}
-	else {
-		memcpy((image + sp->s_first_data_block + offset_extent->start + offset), buf, size);
+	// A short copy leaves the file no longer than the data
+	if (done < size) file_write_end(fs, target_inode_index, old_size, offset, done);
+	if (done == 0) goto end;
+
+	if (clock_gettime(CLOCK_REALTIME, &target_inode->mtime) == -1) {
+		perror("clock_gettime");
+		ret = -ENOSYS;
+		goto end;
 	}
+	ret = done;
+end:
+	inode_unlock(fs, target_inode_index);
+	return ret;
+}
+
+
+/**
+ * Allocate or deallocate space for a range of a file.
+ *
+ * Implements the fallocate() system call. Mode 0 allocates data blocks for the
+ * holes in the range (as contiguously as the free space allows) and extends
+ * the file if the range goes past its end; FALLOC_FL_KEEP_SIZE leaves the size
+ * unchanged, preallocating blocks past the end for later appends.
+ * FALLOC_FL_PUNCH_HOLE (always together with FALLOC_FL_KEEP_SIZE) frees the
+ * blocks in the range, which then reads back as zeros.
+ *
+ * Assumptions (already verified by FUSE using getattr() calls):
+ *   "path" exists and is a file.
+ *
+ * Errors:
+ *   EINVAL      invalid offset or length.
+ *   EOPNOTSUPP  unsupported mode.
+ *   EFBIG       the range is past the maximum file size.
+ *   ENOSPC      not enough free space in the file system.
+ *
+ * @param path    path to the file.
+ * @param mode    0 or a combination of FALLOC_FL_* flags.
+ * @param offset  offset of the range.
+ * @param length  length of the range in bytes.
+ * @param fi      open file information; see file_lookup().
+ * @return        0 on success; -errno on error.
+ */
+static int a1fs_fallocate(const char *path, int mode, off_t offset,
+                          off_t length, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs();
+
+	if ((offset < 0) || (length <= 0)) return -EINVAL;
 
-	return size;
+	a1fs_ino_t target_inode_index;
+	extent_cursor *cursor;
+	int ret = file_lookup(fs, path, fi, &target_inode_index, &cursor);
+	if (ret != 0) return ret;
+
+	inode_wrlock(fs, target_inode_index);
+	ret = file_fallocate(fs, target_inode_index, mode, offset, length);
+	inode_unlock(fs, target_inode_index);
+	return ret;
+}
+
+
+/**
+ * Find the next data or hole in a file.
+ *
+ * Implements lseek() with SEEK_DATA and SEEK_HOLE; see file_seek(). The other
+ * kinds of seek are handled by the kernel, which knows the file size.
+ *
+ * Errors:
+ *   ENXIO   the offset is at or past the end of the file, or there is no
+ *           data after it (SEEK_DATA).
+ *   EINVAL  unsupported whence.
+ *
+ * @param path    path to the file.
+ * @param offset  offset to search from.
+ * @param whence  SEEK_DATA or SEEK_HOLE.
+ * @param fi      open file information; see file_lookup().
+ * @return        the offset found on success; -errno on error.
+ */
+static off_t a1fs_lseek(const char *path, off_t offset, int whence,
+                        struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs();
+
+	if ((whence != SEEK_DATA) && (whence != SEEK_HOLE)) return -EINVAL;
+
+	a1fs_ino_t target_inode_index;
+	extent_cursor *cursor;
+	int ret = file_lookup(fs, path, fi, &target_inode_index, &cursor);
+	if (ret != 0) return ret;
+
+	inode_rdlock(fs, target_inode_index);
+	off_t found = file_seek(fs, target_inode_index, offset, whence == SEEK_HOLE);
+	inode_unlock(fs, target_inode_index);
+	return found;
 }
 
 
 static struct fuse_operations a1fs_ops = {
+	.init     = a1fs_conn_init,
 	.destroy  = a1fs_destroy,
 	.statfs   = a1fs_statfs,
 	.getattr  = a1fs_getattr,
+	.opendir  = a1fs_opendir,
 	.readdir  = a1fs_readdir,
+	.releasedir = a1fs_release,
 	.mkdir    = a1fs_mkdir,
 	.rmdir    = a1fs_rmdir,
 	.create   = a1fs_create,
+	.open     = a1fs_open,
+	.release  = a1fs_release,
 	.unlink   = a1fs_unlink,
 	.utimens  = a1fs_utimens,
 	.truncate = a1fs_truncate,
 	.read     = a1fs_read,
 	.write    = a1fs_write,
+	.read_buf = a1fs_read_buf,
+	.write_buf = a1fs_write_buf,
+	.fallocate = a1fs_fallocate,
+	.lseek    = a1fs_lseek,
 };
 
 int main(int argc, char *argv[])
@@ -1164,5 +1054,11 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	// FUSE reads the blocks that read_buf() refers to after it returns and
+	// the file lock is dropped, when another thread may already have freed
+	// and reused them, and the high-level API doesn't tell when it is done.
+	// With more than one thread, copy under the lock instead (see --help).
+	if (!opts.single_thread) a1fs_ops.read_buf = NULL;
+
 	return fuse_main(args.argc, args.argv, &a1fs_ops, &fs);
 }
\ No newline at end of file
@@ -19,6 +19,7 @@
 #pragma once
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <limits.h>
 #include <sys/stat.h>
@@ -35,7 +36,7 @@
 #define A1FS_BLOCK_SIZE 4096
 
 /** Block number (block pointer) type. */
-typedef uint32_t a1fs_blk_t;
+typedef uint64_t a1fs_blk_t;
 
 /** Inode number type. */
 typedef uint32_t a1fs_ino_t;
@@ -53,19 +54,21 @@ typedef struct a1fs_superblock {
 
 	//TODO: add necessary fields
 	unsigned int   s_inodes_count;      /* Inodes count */
-	unsigned int   s_blocks_count;      /* Blocks count */
-	unsigned int   datablocks_count;      /* data Blocks count */
-
-
 	unsigned int   inodes_usd;			/* inode used */
-	unsigned int   blocks_usd;			/* Block used */
+	a1fs_blk_t     s_blocks_count;      /* Blocks count */
+	a1fs_blk_t     datablocks_count;      /* data Blocks count */
+	a1fs_blk_t     blocks_usd;			/* Block used */
 
 
-	unsigned int   s_first_data_block;  /* location of first Data Block */
-	unsigned int   s_first_inode;  		/* location of first Inode */
+	a1fs_blk_t     s_first_data_block;  /* block number of the first Data Block */
 
-	unsigned int   inode_bitmap_pt;  	/* location of inode bitmap  */
-	unsigned int   data_bitmap_pt;  	/* location of data bitmap */
+	unsigned int   s_groups_count;		/* number of block groups */
+	unsigned int   s_blocks_per_group;	/* blocks in each group (but maybe the last) */
+	unsigned int   s_inodes_per_group;	/* inodes in each group */
+	a1fs_blk_t     s_group_desc_blk;	/* block number of the group descriptor table */
+
+	unsigned int   s_features;		/* A1FS_FEATURE_* flags chosen at mkfs time */
+	unsigned int   s_log_cluster_size;	/* log2 of blocks per allocation cluster (A1FS_FEATURE_BIGALLOC) */
 
 } a1fs_superblock;
 
@@ -73,16 +76,176 @@ typedef struct a1fs_superblock {
 static_assert(sizeof(a1fs_superblock) <= A1FS_BLOCK_SIZE,
               "superblock is too large");
 
+/** Feature flag: directories use variable-length entries (a1fs_vdentry). */
+#define A1FS_FEATURE_VAR_DENTRY 0x1
+/**
+ * Feature flag: the image is divided into block groups. Always set by mkfs;
+ * images without it predate block groups and can't be mounted.
+ */
+#define A1FS_FEATURE_BLOCK_GROUPS 0x2
+/**
+ * Feature flag: blocks are addressed by 64-bit block numbers (rather than by
+ * 32-bit byte offsets that limited images to 4 GiB). Always set by mkfs;
+ * images without it can't be mounted.
+ */
+#define A1FS_FEATURE_64BIT 0x4
+/**
+ * Feature flag: data space is allocated in clusters of 2^s_log_cluster_size
+ * blocks. The block bitmaps track clusters, and every extent starts on a
+ * cluster boundary and owns the clusters up to its end; regular file extents
+ * also map whole clusters. Blocks remain the unit of I/O and addressing.
+ */
+#define A1FS_FEATURE_BIGALLOC 0x8
+
+/** Largest allocation cluster: 2^8 blocks (1 MiB). */
+#define A1FS_MAX_LOG_CLUSTER_SIZE 8
+
+
+/**
+ * Largest number of clusters (blocks without bigalloc) in a block group: as
+ * many as the block bitmap of the group (a single block) can track.
+ */
+#define A1FS_BLOCKS_PER_GROUP (A1FS_BLOCK_SIZE * 8)
+
+/**
+ * Block group descriptor.
+ *
+ * The image is divided into groups of s_blocks_per_group blocks. Each group
+ * has its own block bitmap, inode bitmap and inode table, placed at the start
+ * of the group (after the superblock and the descriptor table in group 0), so
+ * that the inodes of a group and the data blocks near them are close together.
+ * Block bitmaps cover all blocks (or clusters) of their group, metadata
+ * included, so block numbers and data block numbers are the same
+ * (s_first_data_block is 0).
+ * Inode ino is entry ino % s_inodes_per_group of the table of group
+ * ino / s_inodes_per_group.
+ */
+typedef struct a1fs_group_desc {
+	/** Block number of the block bitmap. */
+	a1fs_blk_t block_bitmap;
+	/** Block number of the inode bitmap. */
+	a1fs_blk_t inode_bitmap;
+	/** Block number of the first block of the inode table. */
+	a1fs_blk_t inode_table;
+	/** Number of free blocks in the group. */
+	uint32_t free_blocks;
+	/** Number of free inodes in the group. */
+	uint32_t free_inodes;
+
+} a1fs_group_desc;
+
+static_assert(A1FS_BLOCK_SIZE % sizeof(a1fs_group_desc) == 0, "invalid group descriptor size");
+
 
 /** Extent - a contiguous range of blocks. */
 typedef struct a1fs_extent {
 	/** Starting block of the extent. */
 	a1fs_blk_t start;
 	/** Number of blocks in the extent. */
-	a1fs_blk_t count;
+	uint32_t count;
+	uint32_t pad;
 
 } a1fs_extent;
 
+/** Number of extents in the extent block of a directory. */
+#define A1FS_EXTENTS_PER_BLOCK (A1FS_BLOCK_SIZE / sizeof(a1fs_extent))
+
+
+/** Magic value identifying an extent tree node. */
+#define A1FS_EXTENT_NODE_MAGIC 0xA1E7
+
+/** Maximum depth of an extent tree; enough to map every 32-bit logical block. */
+#define A1FS_EXTENT_MAX_DEPTH 4
+
+/** Extent tree leaf entry - an extent of a regular file. */
+typedef struct a1fs_extent_leaf {
+	/** Logical block of the first block of the extent. */
+	uint32_t lblk;
+	uint32_t pad;
+	/** The blocks. */
+	a1fs_extent extent;
+
+} a1fs_extent_leaf;
+
+/** Extent tree index entry. */
+typedef struct a1fs_extent_idx {
+	/** Lowest logical block mapped by the child (ignored for the first child). */
+	uint32_t lblk;
+	uint32_t pad;
+	/** Block number of the child node. */
+	a1fs_blk_t child;
+
+} a1fs_extent_idx;
+
+/** Number of entries in a leaf node of an extent tree. */
+#define A1FS_EXTENT_LEAF_MAX ((A1FS_BLOCK_SIZE - 8) / sizeof(a1fs_extent_leaf))
+/** Number of entries in an index node of an extent tree. */
+#define A1FS_EXTENT_IDX_MAX ((A1FS_BLOCK_SIZE - 8) / sizeof(a1fs_extent_idx))
+
+/**
+ * Extent tree node - one block.
+ *
+ * The extents of a regular file are kept in a B+tree keyed by logical block,
+ * so that mapping a file offset costs O(log n) and a file can have any number
+ * of extents. Logical blocks that no extent maps are holes and read back as
+ * zeros. The root node is a small one stored in the inode (see
+ * a1fs_extent_root), so files with a few extents need no extent blocks at
+ * all; it never moves, the tree grows by pushing its entries down into a new
+ * child block.
+ */
+typedef struct a1fs_extent_node {
+	/** Must match A1FS_EXTENT_NODE_MAGIC (unused in the root). */
+	uint16_t magic;
+	/** Number of valid entries. */
+	uint16_t nentries;
+	/** Height of the node above the leaves; 0 for a leaf. */
+	uint16_t depth;
+	uint16_t pad;
+	/** Leaf entries (depth == 0) or index entries (depth > 0), sorted by lblk. */
+	union {
+		a1fs_extent_leaf leaf[A1FS_EXTENT_LEAF_MAX];
+		a1fs_extent_idx idx[A1FS_EXTENT_IDX_MAX];
+	};
+
+} a1fs_extent_node;
+
+static_assert(sizeof(a1fs_extent_node) <= A1FS_BLOCK_SIZE, "invalid extent node size");
+
+/** Number of leaf entries in the extent tree root. */
+#define A1FS_EXTENT_ROOT_LEAF_MAX 7
+/** Number of index entries in the extent tree root. */
+#define A1FS_EXTENT_ROOT_IDX_MAX 11
+
+/** Extent tree root - the same layout as a node, with room for fewer entries. */
+typedef struct a1fs_extent_root {
+	uint16_t magic;
+	uint16_t nentries;
+	uint16_t depth;
+	uint16_t pad;
+	union {
+		a1fs_extent_leaf leaf[A1FS_EXTENT_ROOT_LEAF_MAX];
+		a1fs_extent_idx idx[A1FS_EXTENT_ROOT_IDX_MAX];
+	};
+
+} a1fs_extent_root;
+
+
+/**
+ * Inode flag: the contents of the (regular) file are stored in the inode.
+ *
+ * Directories are never stored inline. A fixed-size entry doesn't fit, and
+ * with A1FS_FEATURE_VAR_DENTRY only a handful of short names do (about 9 of 8
+ * characters), after which the directory moves to a block anyway. Directory
+ * entries are also addressed by their location in the data region (hashed
+ * index slots, readdir positions), which an inline directory would need a
+ * separate path for in every directory operation. An empty directory already
+ * takes no data blocks.
+ */
+#define A1FS_INODE_INLINE_DATA 0x1
+
+/** Maximum size of a file whose contents are stored in the inode. */
+#define A1FS_INLINE_DATA_MAX sizeof(a1fs_extent_root)
+
 
 /** a1fs inode. */
 typedef struct a1fs_inode {
@@ -112,16 +275,24 @@ typedef struct a1fs_inode {
 	struct timespec mtime;
 
 	//TODO: add necessary fields
-	struct a1fs_extent extent1;
+	int extent_used;		/* number of extents */
 
-	// struct a1fs_extent extent2;
+	a1fs_blk_t index_pt;		/* first block of the hashed directory index (directories only) */
+	int index_blocks;		/* number of blocks in the directory index; 0 if not indexed */
 
-	int extent_used;
-	
-	char pad[12];
+	uint32_t blocks;		/* number of data blocks (regular files only) */
+
+	a1fs_blk_t extend_pt;		/* block number of the extent block (directories only) */
+
+	union {
+		a1fs_extent_root root;	/* root of the extent tree (regular files only) */
+		char inline_data[A1FS_INLINE_DATA_MAX];	/* contents of a small file (A1FS_INODE_INLINE_DATA) */
+	};
+
+	uint32_t flags;			/* A1FS_INODE_* flags */
+
+	char pad[4];
 
-	int extend_pt;			/* pointer points to the first extent in extent block */
-	
 	// uint64_t last_ext_pt;		/* pointer points to the last extent */
 
 	//NOTE: You might have to add padding (e.g. a dummy char array field) at the
@@ -133,6 +304,7 @@ typedef struct a1fs_inode {
 
 // A single block must fit an integral number of inodes
 static_assert(A1FS_BLOCK_SIZE % sizeof(a1fs_inode) == 0, "invalid inode size");
+static_assert(offsetof(a1fs_extent_root, leaf) == offsetof(a1fs_extent_node, leaf), "invalid extent root layout");
 
 
 /** Maximum file name (path component) length. Includes the null terminator. */
@@ -151,3 +323,93 @@ typedef struct a1fs_dentry {
 } a1fs_dentry;
 
 static_assert(sizeof(a1fs_dentry) == 256, "invalid dentry size");
+
+/**
+ * Variable-length directory entry, used instead of a1fs_dentry if the file
+ * system has A1FS_FEATURE_VAR_DENTRY.
+ *
+ * The entries of a directory block form a chain linked by rec_len that covers
+ * exactly the whole block, so an entry never spans two blocks. An entry may
+ * have unused space after its name, from which a new entry can be split off.
+ * A removed entry is merged into the previous entry of its block; the first
+ * entry of a block is marked free (ino 0) instead.
+ */
+typedef struct a1fs_vdentry {
+	/** Inode number; 0 if the entry is free (the root is never an entry). */
+	a1fs_ino_t ino;
+	/** Distance to the next entry in bytes (a multiple of A1FS_VDENTRY_ALIGN). */
+	uint16_t rec_len;
+	/** Length of the name, not including the null terminator. */
+	uint8_t name_len;
+	uint8_t pad;
+	/** File name. A null-terminated string. */
+	char name[];
+
+} a1fs_vdentry;
+
+/** Alignment of variable-length directory entries. */
+#define A1FS_VDENTRY_ALIGN 4
+
+/** Number of bytes a variable-length entry with a name of the given length needs. */
+#define A1FS_VDENTRY_LEN(name_len) \
+	((sizeof(a1fs_vdentry) + (name_len) + 1 + A1FS_VDENTRY_ALIGN - 1) & ~(size_t)(A1FS_VDENTRY_ALIGN - 1))
+
+static_assert(A1FS_NAME_MAX - 1 <= UINT8_MAX, "name length doesn't fit in a1fs_vdentry");
+
+
+/** Magic value identifying a hashed directory index. */
+#define A1FS_DIR_INDEX_MAGIC 0xA1D1DE1Cu
+
+/** Bucket slot value marking a deleted entry. */
+#define A1FS_DIR_BUCKET_DELETED UINT64_MAX
+
+/**
+ * Hashed directory index header.
+ *
+ * Large directories keep an open-addressing hash table of their entries in a
+ * contiguous run of index_blocks blocks starting at index_pt. The first block
+ * of the run is this header; the remaining blocks hold the buckets.
+ *
+ * Directory entries are referenced by their "dentry number" - byte offset from
+ * the first data block divided by the dentry size (or by A1FS_VDENTRY_ALIGN
+ * for variable-length entries). Entries never move while they are live, so
+ * these references stay valid until the entry is removed.
+ */
+typedef struct a1fs_dir_index {
+	/** Must match A1FS_DIR_INDEX_MAGIC. */
+	uint32_t magic;
+	/** Number of buckets (a power of 2). */
+	uint32_t nbuckets;
+	/** Number of buckets referencing a live entry. */
+	uint32_t nlive;
+	/** Number of buckets marked as deleted. */
+	uint32_t ndeleted;
+	/**
+	 * First never used dentry slot at the end of the directory (dentry
+	 * number). With variable-length entries, the last entry of the newest
+	 * extent that may have room after it.
+	 */
+	uint64_t tail;
+	/** Number of dentry numbers from tail to the end of its extent. */
+	uint32_t tail_left;
+	/** Number of valid entries in free_slots. */
+	uint32_t nfree;
+	/** Stack of dentry numbers of free (removed) slots, or entries with room after them, available for reuse. */
+	uint64_t free_slots[A1FS_BLOCK_SIZE / sizeof(uint64_t) - 4];
+
+} a1fs_dir_index;
+
+static_assert(sizeof(a1fs_dir_index) == A1FS_BLOCK_SIZE, "invalid dir index size");
+
+/** Hashed directory index bucket. */
+typedef struct a1fs_dir_bucket {
+	/** Hash of the entry name. */
+	uint32_t hash;
+	uint32_t pad;
+	/** Dentry number + 1; 0 if empty, A1FS_DIR_BUCKET_DELETED if deleted. */
+	uint64_t slot;
+
+} a1fs_dir_bucket;
+
+/** Number of buckets in one block of the directory index. */
+#define A1FS_DIR_BUCKETS_PER_BLOCK (A1FS_BLOCK_SIZE / sizeof(a1fs_dir_bucket))
@@ -0,0 +1,768 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - a1fs low-level (inode-based) driver implementation.
+ *
+ * An alternative to the path-based driver in a1fs.c for the same image: the
+ * kernel looks up each name once and then refers to files by inode number, so
+ * no request walks a path. The file system operations themselves are shared
+ * with a1fs.c (see helper.c).
+ */
+
+// For SEEK_DATA and SEEK_HOLE
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Using 3.x FUSE API
+#define FUSE_USE_VERSION 31
+#include <fuse_lowlevel.h>
+
+#include "helper.c"
+#include "a1fs.h"
+#include "fs_ctx.h"
+#include "options.h"
+#include "util.h"
+
+
+/** Low-level driver runtime state. */
+typedef struct ll_ctx {
+	/** File system context. */
+	fs_ctx fs;
+	/**
+	 * Number of lookups of each inode the kernel hasn't forgotten yet. An
+	 * unlinked inode is only freed once this drops to 0, since the kernel
+	 * may still read or write it through an open file.
+	 */
+	uint64_t *nlookup;
+	/** Inodes unlinked while still looked up; protected by the inode locks. */
+	bool *orphan;
+	/**
+	 * Modification time of each file when it was last opened, for the
+	 * auto_cache option; protected by the inode locks. NULL without it.
+	 */
+	struct timespec *open_mtime;
+	/** Session with the kernel, for sending notifications; NULL until mounted. */
+	struct fuse_session *se;
+
+} ll_ctx;
+
+/** Get the driver state of a request. */
+static ll_ctx *get_ll(fuse_req_t req)
+{
+	return (ll_ctx*)fuse_req_userdata(req);
+}
+
+// FUSE numbers the root directory 1; a1fs numbers it 0
+static inline fuse_ino_t fuse_ino(a1fs_ino_t ino)
+{
+	return (fuse_ino_t)ino + FUSE_ROOT_ID;
+}
+
+static inline a1fs_ino_t a1fs_ino(fuse_ino_t ino)
+{
+	return ino - FUSE_ROOT_ID;
+}
+
+/** Get the extent lookup cursor of an open file (see a1fs_ll_open()), if any. */
+static inline extent_cursor *ll_cursor(struct fuse_file_info *fi)
+{
+	return (fi != NULL) ? (extent_cursor*)(uintptr_t)fi->fh : NULL;
+}
+
+
+/**
+ * Fill in the entry the kernel gets for a lookup, without counting the lookup.
+ * The caller holds the lock of the parent directory.
+ */
+static void ll_fill_entry(ll_ctx *ll, a1fs_ino_t ino, struct fuse_entry_param *e)
+{
+	memset(e, 0, sizeof(*e));
+	e->ino = fuse_ino(ino);
+	e->attr_timeout = ll->fs.opts->attr_timeout;
+	e->entry_timeout = ll->fs.opts->entry_timeout;
+
+	inode_rdlock(&ll->fs, ino);
+	inode_stat(inode_at(&ll->fs, ino), &e->attr);
+	inode_unlock(&ll->fs, ino);
+	e->attr.st_ino = e->ino;
+}
+
+/**
+ * Fill in the entry the kernel gets for a lookup and count the lookup. The
+ * caller holds the lock of the parent directory.
+ */
+static void ll_entry(ll_ctx *ll, a1fs_ino_t ino, struct fuse_entry_param *e)
+{
+	ll_fill_entry(ll, ino, e);
+	__atomic_add_fetch(&ll->nlookup[ino], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Make the kernel drop the cached attributes of a directory whose entries a
+ * request has changed (its size and mtime change along with them). Sent after
+ * the reply; the cached data is left alone, since dropping it could wait for
+ * writeback that needs a reply from this thread.
+ *
+ * NOTE: files aren't invalidated, as in the path-based driver (see
+ * dir_changed() in a1fs.c): the kernel keeps the attributes of a file it
+ * writes or fallocates up to date (or drops them) itself.
+ */
+static void ll_changed(ll_ctx *ll, a1fs_ino_t ino)
+{
+	if (ll->se != NULL) fuse_lowlevel_notify_inval_inode(ll->se, fuse_ino(ino), -1, 0);
+}
+
+/** Drop n lookups of an inode; the last one frees it if it has been unlinked. */
+static void ll_forget_one(ll_ctx *ll, a1fs_ino_t ino, uint64_t n)
+{
+	fs_ctx *fs = &ll->fs;
+	if ((ino == 0) || (__atomic_sub_fetch(&ll->nlookup[ino], n, __ATOMIC_RELAXED) != 0)) return;
+
+	// An unlink that saw the old count has marked the inode by now
+	inode_wrlock(fs, ino);
+	if (ll->orphan[ino] && (__atomic_load_n(&ll->nlookup[ino], __ATOMIC_RELAXED) == 0)) {
+		ll->orphan[ino] = false;
+		inode_free(fs, ino);
+	}
+	inode_unlock(fs, ino);
+}
+
+
+/** Negotiate the connection with the kernel; see conn_init(). */
+static void a1fs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	conn_init(&((ll_ctx*)userdata)->fs, conn);
+}
+
+/** Look up a directory entry by name; see fuse_lowlevel_ops::lookup. */
+static void a1fs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	ll_ctx *ll = get_ll(req);
+	fs_ctx *fs = &ll->fs;
+	if (strlen(name) >= A1FS_NAME_MAX) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+
+	a1fs_ino_t dir_ino = a1fs_ino(parent);
+	inode_rdlock(fs, dir_ino);
+	struct a1fs_inode *dir = inode_at(fs, dir_ino);
+	if (!S_ISDIR(dir->mode)) {
+		inode_unlock(fs, dir_ino);
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	struct a1fs_dentry *entry = dir_find_entry(fs, dir, name);
+	struct fuse_entry_param e;
+	if (entry == NULL) {
+		inode_unlock(fs, dir_ino);
+		if (fs->opts->negative_timeout == 0) {
+			fuse_reply_err(req, ENOENT);
+			return;
+		}
+		// An entry with inode number 0 has the kernel cache that it's missing
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = fs->opts->negative_timeout;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+
+	ll_entry(ll, entry->ino, &e);
+	inode_unlock(fs, dir_ino);
+	fuse_reply_entry(req, &e);
+}
+
+/** Forget lookups of an inode; see fuse_lowlevel_ops::forget. */
+static void a1fs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	ll_forget_one(get_ll(req), a1fs_ino(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+/** Forget lookups of several inodes; see fuse_lowlevel_ops::forget_multi. */
+static void a1fs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	for (size_t i = 0; i < count; i++) {
+		ll_forget_one(get_ll(req), a1fs_ino(forgets[i].ino), forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+/** Get file or directory attributes; see a1fs_getattr(). */
+static void a1fs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	fs_ctx *fs = &get_ll(req)->fs;
+
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	inode_rdlock(fs, a1fs_ino(ino));
+	inode_stat(inode_at(fs, a1fs_ino(ino)), &st);
+	inode_unlock(fs, a1fs_ino(ino));
+	st.st_ino = ino;
+	fuse_reply_attr(req, &st, fs->opts->attr_timeout);
+}
+
+/**
+ * Change the size and/or the modification time of a file; see a1fs_truncate()
+ * and a1fs_utimens(). Other attributes can't be changed.
+ */
+static void a1fs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                            int to_set, struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	fs_ctx *fs = &get_ll(req)->fs;
+	if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	a1fs_ino_t target_ino = a1fs_ino(ino);
+	inode_wrlock(fs, target_ino);
+	struct a1fs_inode *target = inode_at(fs, target_ino);
+	int ret = 0;
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		if (S_ISDIR(target->mode)) {
+			ret = -EISDIR;
+			goto end;
+		}
+		ret = file_resize(fs, target_ino, attr->st_size);
+		if (ret != 0) goto end;
+		if (!(to_set & FUSE_SET_ATTR_MTIME)) to_set |= FUSE_SET_ATTR_MTIME_NOW;
+	}
+	if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+		if (clock_gettime(CLOCK_REALTIME, &target->mtime) == -1) {
+			perror("clock_gettime");
+			ret = -ENOSYS;
+			goto end;
+		}
+	} else if (to_set & FUSE_SET_ATTR_MTIME) {
+		target->mtime = attr->st_mtim;
+	}
+	inode_stat(target, &st);
+	st.st_ino = ino;
+end:
+	inode_unlock(fs, target_ino);
+	if (ret != 0) {
+		fuse_reply_err(req, -ret);
+	} else {
+		fuse_reply_attr(req, &st, fs->opts->attr_timeout);
+	}
+}
+
+/** A readdir() reply being filled in; see ll_readdir_add(). */
+typedef struct ll_dirbuf {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t used;
+	/** Whether the entries are passed with their attributes (readdirplus). */
+	bool plus;
+
+} ll_dirbuf;
+
+/** Add a directory entry to a readdir() reply; see dir_iterate(). */
+static bool ll_readdir_add(fs_ctx *fs, struct a1fs_dentry *entry, off_t next, void *arg)
+{
+	ll_dirbuf *db = arg;
+
+	if (db->plus) {
+		// Each entry passed counts as a lookup, but only if it fits
+		ll_ctx *ll = get_ll(db->req);
+		struct fuse_entry_param e;
+		ll_fill_entry(ll, entry->ino, &e);
+		size_t len = fuse_add_direntry_plus(db->req, db->buf + db->used, db->size - db->used,
+		                                    dentry_name(fs, entry), &e, next);
+		if (len > db->size - db->used) return false;
+		__atomic_add_fetch(&ll->nlookup[entry->ino], 1, __ATOMIC_RELAXED);
+		db->used += len;
+		return true;
+	}
+
+	// Only the inode number and the file type are passed on
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	st.st_ino = fuse_ino(entry->ino);
+	st.st_mode = inode_at(fs, entry->ino)->mode;
+	size_t len = fuse_add_direntry(db->req, db->buf + db->used, db->size - db->used,
+	                               dentry_name(fs, entry), &st, next);
+	if (len > db->size - db->used) return false;
+	db->used += len;
+	return true;
+}
+
+/**
+ * Read a directory, with or without the attributes of the entries; shared by
+ * readdir() and readdirplus(). The offset of an entry is the position of the
+ * entry after it, so a listing that doesn't fit into one reply continues where
+ * the previous one stopped.
+ */
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, bool plus)
+{
+	fs_ctx *fs = &get_ll(req)->fs;
+
+	ll_dirbuf db = {req, malloc(size), size, 0, plus};
+	if (db.buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	a1fs_ino_t dir_ino = a1fs_ino(ino);
+	inode_rdlock(fs, dir_ino);
+	dir_iterate(fs, inode_at(fs, dir_ino), off, ll_readdir_add, &db);
+	inode_unlock(fs, dir_ino);
+
+	fuse_reply_buf(req, db.buf, db.used);
+	free(db.buf);
+}
+
+/** Read a directory; see a1fs_readdir(). */
+static void a1fs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                            struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	ll_readdir(req, ino, size, off, false);
+}
+
+/**
+ * Read a directory along with the attributes of the entries; see
+ * a1fs_readdir(). Saves the kernel a lookup() per entry.
+ */
+static void a1fs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                                struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	ll_readdir(req, ino, size, off, true);
+}
+
+/**
+ * Open a directory. Nothing is set up (directories are read by inode number),
+ * but the open handles are counted, so that the directory isn't compacted
+ * under a listing; see dir_tidy().
+ */
+static void a1fs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = &get_ll(req)->fs;
+	a1fs_ino_t dir_ino = a1fs_ino(ino);
+
+	inode_wrlock(fs, dir_ino);
+	fs->open_count[dir_ino]++;
+	inode_unlock(fs, dir_ino);
+	fi->fh = 0;
+	fuse_reply_open(req, fi);
+}
+
+/** Release an open directory; the last handle compacts it if it is due. */
+static void a1fs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	fs_ctx *fs = &get_ll(req)->fs;
+	a1fs_ino_t dir_ino = a1fs_ino(ino);
+
+	inode_wrlock(fs, dir_ino);
+	if (--fs->open_count[dir_ino] == 0) dir_tidy(fs, dir_ino);
+	inode_unlock(fs, dir_ino);
+	fuse_reply_err(req, 0);
+}
+
+/**
+ * Create a new inode and link it into a directory; shared by mkdir() and
+ * create(). Replies with the entry of the new inode.
+ */
+static void ll_create_node(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                           uint32_t links, struct fuse_file_info *fi)
+{
+	ll_ctx *ll = get_ll(req);
+	fs_ctx *fs = &ll->fs;
+	if (strlen(name) >= A1FS_NAME_MAX) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+
+	a1fs_ino_t dir_ino = a1fs_ino(parent);
+	inode_wrlock(fs, dir_ino);
+	struct a1fs_inode *dir = inode_at(fs, dir_ino);
+	a1fs_ino_t new_ino;
+	int ret = (dir_find_entry(fs, dir, name) != NULL) ? -EEXIST
+	        : node_create(fs, dir, name, mode, links, &new_ino);
+	if (ret != 0) {
+		inode_unlock(fs, dir_ino);
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	struct fuse_entry_param e;
+	ll_entry(ll, new_ino, &e);
+	inode_unlock(fs, dir_ino);
+	if (fi != NULL) {
+		// Failing to open leaves the file to the extent cursor shared by all
+		fi->fh = (uintptr_t)cursor_new(new_ino);
+		fuse_reply_create(req, &e, fi);
+	} else {
+		fuse_reply_entry(req, &e);
+	}
+	ll_changed(ll, dir_ino);
+}
+
+/** Create a directory; see a1fs_mkdir(). */
+static void a1fs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	ll_create_node(req, parent, name, mode | S_IFDIR, 2, NULL);
+}
+
+/** Create and open a file; see a1fs_create(). */
+static void a1fs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                           struct fuse_file_info *fi)
+{
+	ll_create_node(req, parent, name, (mode & ~S_IFMT) | S_IFREG, 1, fi);
+}
+
+/**
+ * Remove a directory entry; shared by unlink() and rmdir(). The inode is freed
+ * right away unless the kernel still refers to it; see ll_forget_one().
+ */
+static void ll_remove_node(fuse_req_t req, fuse_ino_t parent, const char *name, bool is_dir)
+{
+	ll_ctx *ll = get_ll(req);
+	fs_ctx *fs = &ll->fs;
+
+	a1fs_ino_t dir_ino = a1fs_ino(parent);
+	inode_wrlock(fs, dir_ino);
+	struct a1fs_inode *dir = inode_at(fs, dir_ino);
+	struct a1fs_dentry *entry = dir_find_entry(fs, dir, name);
+	if (entry == NULL) {
+		inode_unlock(fs, dir_ino);
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	// Parent before child; the child lock waits out anyone still using it
+	a1fs_ino_t target_ino = entry->ino;
+	inode_wrlock(fs, target_ino);
+	struct a1fs_inode *target = inode_at(fs, target_ino);
+	int ret = 0;
+	if (is_dir && !S_ISDIR(target->mode)) {
+		ret = -ENOTDIR;
+	} else if (!is_dir && S_ISDIR(target->mode)) {
+		ret = -EISDIR;
+	} else if (is_dir && (target->size != 0)) {
+		ret = -ENOTEMPTY;
+	} else if ((ret = node_unlink(fs, dir_ino, name, target)) == 0) {
+		if (__atomic_load_n(&ll->nlookup[target_ino], __ATOMIC_RELAXED) == 0) {
+			inode_free(fs, target_ino);
+		} else {
+			ll->orphan[target_ino] = true;
+		}
+	}
+	inode_unlock(fs, target_ino);
+	inode_unlock(fs, dir_ino);
+	fuse_reply_err(req, -ret);
+	if (ret == 0) ll_changed(ll, dir_ino);
+}
+
+/** Remove a file; see a1fs_unlink(). */
+static void a1fs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	ll_remove_node(req, parent, name, false);
+}
+
+/** Remove a directory; see a1fs_rmdir(). */
+static void a1fs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	ll_remove_node(req, parent, name, true);
+}
+
+/**
+ * Open a file; see a1fs_open(). The file handle is the extent lookup cursor of
+ * the open file; the inode number comes with every request anyway.
+ *
+ * With kernel_cache the kernel keeps the cached data of the file; with
+ * auto_cache only if the file hasn't been modified since it was last opened.
+ */
+static void a1fs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	ll_ctx *ll = get_ll(req);
+	fs_ctx *fs = &ll->fs;
+	a1fs_ino_t target_ino = a1fs_ino(ino);
+
+	fi->keep_cache = fs->opts->kernel_cache;
+	if (!fi->keep_cache && (ll->open_mtime != NULL)) {
+		inode_wrlock(fs, target_ino);
+		struct timespec mtime = inode_at(fs, target_ino)->mtime;
+		struct timespec *last = &ll->open_mtime[target_ino];
+		fi->keep_cache = (mtime.tv_sec == last->tv_sec) && (mtime.tv_nsec == last->tv_nsec);
+		*last = mtime;
+		inode_unlock(fs, target_ino);
+	}
+
+	fi->fh = (uintptr_t)cursor_new(target_ino);
+	if (fi->fh == 0) {
+		fuse_reply_err(req, ENOMEM);
+	} else {
+		fuse_reply_open(req, fi);
+	}
+}
+
+/** Release an open file; see a1fs_release(). */
+static void a1fs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)ino;// unused
+	free(ll_cursor(fi));
+	fuse_reply_err(req, 0);
+}
+
+/**
+ * Read data from a file; see a1fs_read(). The reply refers to the extents in
+ * the image file, so the data is spliced into the kernel without a copy. It is
+ * sent before the file is unlocked, so the blocks can't be freed and reused
+ * in the meantime; unlike read_buf() in a1fs.c, this is safe with any number
+ * of threads.
+ */
+static void a1fs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                         struct fuse_file_info *fi)
+{
+	fs_ctx *fs = &get_ll(req)->fs;
+	a1fs_ino_t target_ino = a1fs_ino(ino);
+
+	inode_rdlock(fs, target_ino);
+	struct a1fs_inode *target = inode_at(fs, target_ino);
+	if ((uint64_t)off >= target->size) {
+		size = 0;
+	} else if (size > target->size - off) {
+		size = target->size - off;
+	}
+
+	// Each extent is at least a block long, so this many buffers are enough
+	size_t max_bufs = size / A1FS_BLOCK_SIZE + 2;
+	struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) + (max_bufs - 1) * sizeof(struct fuse_buf));
+	if (bufv == NULL) {
+		inode_unlock(fs, target_ino);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	*bufv = FUSE_BUFVEC_INIT(0);
+
+	int ret = 0;
+	size_t done = 0;
+	bufv->count = 0;
+	while (done < size) {
+		size_t n;
+		void *data = file_data(fs, target_ino, ll_cursor(fi), off + done, &n);
+		if (n > size - done) n = size - done;
+
+		struct fuse_buf *b = &bufv->buf[bufv->count++];
+		b->size = n;
+		if (data != NULL) {
+			b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			b->mem = NULL;
+			b->fd = fs->image_fd;
+			b->pos = data - fs->image;
+		} else {
+			// A hole has nothing to refer to
+			b->flags = 0;
+			b->mem = calloc(1, n);
+			if (b->mem == NULL) {
+				bufv->count--;
+				ret = ENOMEM;
+				break;
+			}
+		}
+		done += n;
+	}
+	if (bufv->count == 0) bufv->count = 1;// empty buffer at EOF
+
+	if (ret != 0) {
+		fuse_reply_err(req, ret);
+	} else {
+		fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+	}
+	inode_unlock(fs, target_ino);
+
+	for (size_t i = 0; i < bufv->count; i++) free(bufv->buf[i].mem);
+	free(bufv);
+}
+
+/** Write data to a file; see a1fs_write(). */
+static void a1fs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                          off_t off, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = &get_ll(req)->fs;
+	a1fs_ino_t target_ino = a1fs_ino(ino);
+
+	inode_wrlock(fs, target_ino);
+	int ret = file_write(fs, target_ino, ll_cursor(fi), buf, size, off);
+	inode_unlock(fs, target_ino);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+	} else {
+		fuse_reply_write(req, ret);
+	}
+}
+
+/** Allocate or deallocate space for a range of a file; see a1fs_fallocate(). */
+static void a1fs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+                              off_t length, struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	fs_ctx *fs = &get_ll(req)->fs;
+	if ((offset < 0) || (length <= 0)) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	a1fs_ino_t target_ino = a1fs_ino(ino);
+	inode_wrlock(fs, target_ino);
+	int ret = file_fallocate(fs, target_ino, mode, offset, length);
+	inode_unlock(fs, target_ino);
+	fuse_reply_err(req, -ret);
+}
+
+/** Find the next data or hole in a file; see a1fs_lseek(). */
+static void a1fs_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+                          struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	fs_ctx *fs = &get_ll(req)->fs;
+	if ((whence != SEEK_DATA) && (whence != SEEK_HOLE)) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	a1fs_ino_t target_ino = a1fs_ino(ino);
+	inode_rdlock(fs, target_ino);
+	off_t found = file_seek(fs, target_ino, off, whence == SEEK_HOLE);
+	inode_unlock(fs, target_ino);
+	if (found < 0) {
+		fuse_reply_err(req, -found);
+	} else {
+		fuse_reply_lseek(req, found);
+	}
+}
+
+/** Get file system statistics; see a1fs_statfs(). */
+static void a1fs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	(void)ino;// unused
+	struct statvfs st;
+	fs_statfs(&get_ll(req)->fs, &st);
+	fuse_reply_statfs(req, &st);
+}
+
+
+static struct fuse_lowlevel_ops a1fs_ll_ops = {
+	.init         = a1fs_ll_init,
+	.lookup       = a1fs_ll_lookup,
+	.forget       = a1fs_ll_forget,
+	.forget_multi = a1fs_ll_forget_multi,
+	.getattr      = a1fs_ll_getattr,
+	.setattr      = a1fs_ll_setattr,
+	.readdir      = a1fs_ll_readdir,
+	.readdirplus  = a1fs_ll_readdirplus,
+	.opendir      = a1fs_ll_opendir,
+	.releasedir   = a1fs_ll_releasedir,
+	.mkdir        = a1fs_ll_mkdir,
+	.create       = a1fs_ll_create,
+	.unlink       = a1fs_ll_unlink,
+	.rmdir        = a1fs_ll_rmdir,
+	.open         = a1fs_ll_open,
+	.release      = a1fs_ll_release,
+	.read         = a1fs_ll_read,
+	.write        = a1fs_ll_write,
+	.fallocate    = a1fs_ll_fallocate,
+	.lseek        = a1fs_ll_lseek,
+	.statfs       = a1fs_ll_statfs,
+};
+
+/**
+ * Mount the image and serve requests until the file system is unmounted.
+ *
+ * @return  0 on success; non-zero on failure.
+ */
+static int ll_serve(ll_ctx *ll, struct fuse_args *args, struct fuse_cmdline_opts *cmd)
+{
+	int err = -1;
+	struct fuse_session *se = fuse_session_new(args, &a1fs_ll_ops, sizeof(a1fs_ll_ops), ll);
+	if (se == NULL) return err;
+	ll->se = se;
+
+	if (fuse_set_signal_handlers(se) == 0) {
+		if (fuse_session_mount(se, cmd->mountpoint) == 0) {
+			fuse_daemonize(cmd->foreground);
+			err = cmd->singlethread ? fuse_session_loop(se) : fuse_session_loop_mt(se, cmd->clone_fd);
+			fuse_session_unmount(se);
+		}
+		fuse_remove_signal_handlers(se);
+	}
+	ll->se = NULL;
+	fuse_session_destroy(se);
+	return err;
+}
+
+int main(int argc, char *argv[])
+{
+	a1fs_opts opts = {0};// defaults are all 0
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if (!a1fs_opt_parse(&args, &opts)) return 1;
+
+	struct fuse_cmdline_opts cmd;
+	if (fuse_parse_cmdline(&args, &cmd) != 0) return 1;
+	if (cmd.show_help) {
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		return 0;
+	}
+	if (cmd.mountpoint == NULL) {
+		fprintf(stderr, "Missing mount point\n");
+		return 1;
+	}
+
+	ll_ctx ll = {0};
+	if (!fs_mount(&ll.fs, &opts)) {
+		fprintf(stderr, "Failed to mount the file system\n");
+		free(cmd.mountpoint);
+		return 1;
+	}
+	ll.nlookup = calloc(ll.fs.inode_bm.nbits, sizeof(uint64_t));
+	ll.orphan = calloc(ll.fs.inode_bm.nbits, sizeof(bool));
+	if (opts.auto_cache) ll.open_mtime = calloc(ll.fs.inode_bm.nbits, sizeof(struct timespec));
+	if ((ll.nlookup == NULL) || (ll.orphan == NULL) || (opts.auto_cache && (ll.open_mtime == NULL))) {
+		perror("calloc");
+		free(ll.nlookup);
+		free(ll.orphan);
+		free(ll.open_mtime);
+		fs_unmount(&ll.fs);
+		free(cmd.mountpoint);
+		return 1;
+	}
+	fs_free_orphans(&ll.fs);
+
+	int err = ll_serve(&ll, &args, &cmd);
+
+	// Files still open at unmount were never forgotten
+	fs_free_orphans(&ll.fs);
+	free(ll.nlookup);
+	free(ll.orphan);
+	free(ll.open_mtime);
+	fs_unmount(&ll.fs);
+	free(cmd.mountpoint);
+	fuse_opt_free_args(&args);
+	return err ? 1 : 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Bitmap engine implementation.
+ */
+
+#include <assert.h>
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "bitmap.h"
+
+
+/** Get a pointer to word w of the bitmap in the image. */
+static inline unsigned char *word_at(const bitmap *bm, size_t w)
+{
+	return bm->segs[w / bm->seg_words] + (w % bm->seg_words) * 8;
+}
+
+/** Load word w of the bitmap; bit 0 of the bitmap is the most significant bit. */
+static inline uint64_t load_word(const bitmap *bm, size_t w)
+{
+	uint64_t v;
+	memcpy(&v, word_at(bm, w), sizeof(v));
+	return be64toh(v);
+}
+
+static inline void store_word(bitmap *bm, size_t w, uint64_t v)
+{
+	v = htobe64(v);
+	memcpy(word_at(bm, w), &v, sizeof(v));
+}
+
+/** Mask of the bits of word w that lie within the bitmap. */
+static inline uint64_t valid_mask(const bitmap *bm, size_t w)
+{
+	size_t r = bm->nbits - w * 64;
+	return (r >= 64) ? ~0ul : ~(~0ul >> r);
+}
+
+/** Mask of bits [from, to) of a word, 0 <= from < to <= 64. */
+static inline uint64_t range_mask(size_t from, size_t to)
+{
+	uint64_t head = ~0ul >> from;
+	uint64_t tail = (to == 64) ? ~0ul : ~(~0ul >> to);
+	return head & tail;
+}
+
+static inline void summary_set(uint64_t *summary, size_t w, bool value)
+{
+	if (value) {
+		summary[w / 64] |= 1ul << (w % 64);
+	} else {
+		summary[w / 64] &= ~(1ul << (w % 64));
+	}
+}
+
+/** Update the summary bits of word w given its new value. */
+static inline void summary_update(bitmap *bm, size_t w, uint64_t v)
+{
+	uint64_t valid = valid_mask(bm, w);
+	summary_set(bm->full, w, (v & valid) == valid);
+	summary_set(bm->empty, w, (v & valid) == 0);
+}
+
+/**
+ * Find the first word in [w, end) whose summary bit is clear.
+ *
+ * @return  index of the word; end if there is none.
+ */
+static size_t summary_find_clear(const uint64_t *summary, size_t w, size_t end)
+{
+	while (w < end) {
+		uint64_t s = ~summary[w / 64] & (~0ul << (w % 64));
+		if (s != 0) {
+			w = (w & ~63ul) + __builtin_ctzl(s);
+			return (w < end) ? w : end;
+		}
+		w = (w & ~63ul) + 64;
+	}
+	return end;
+}
+
+
+bool bitmap_init(bitmap *bm, unsigned char *const *segs, size_t seg_bits, size_t nbits)
+{
+	assert(seg_bits % 256 == 0);
+	bm->seg_words = seg_bits / 64;
+	bm->nbits = nbits;
+	bm->nwords = (nbits + 63) / 64;
+	bm->used = 0;
+
+	size_t nsegs = (bm->nwords + bm->seg_words - 1) / bm->seg_words;
+	size_t nsummary = (bm->nwords + 63) / 64;
+	bm->segs = malloc(nsegs * sizeof(unsigned char *));
+	bm->full = calloc(nsummary, sizeof(uint64_t));
+	bm->empty = calloc(nsummary, sizeof(uint64_t));
+	if ((bm->segs == NULL) || (bm->full == NULL) || (bm->empty == NULL)) {
+		perror("malloc");
+		bitmap_destroy(bm);
+		return false;
+	}
+	memcpy(bm->segs, segs, nsegs * sizeof(unsigned char *));
+
+	size_t w = 0;
+#ifdef __AVX2__
+	// Mounting a nearly full or nearly empty image: classify 4 words at a time
+	// (segments are whole multiples of 4 words)
+	const __m256i ones = _mm256_set1_epi64x(-1);
+	while ((w + 4) * 64 <= nbits) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)word_at(bm, w));
+		if (_mm256_testc_si256(v, ones)) {
+			for (size_t i = w; i < w + 4; i++) summary_set(bm->full, i, true);
+			bm->used += 4 * 64;
+		} else if (_mm256_testz_si256(v, v)) {
+			for (size_t i = w; i < w + 4; i++) summary_set(bm->empty, i, true);
+		} else {
+			break;
+		}
+		w += 4;
+	}
+#endif
+	for (; w < bm->nwords; w++) {
+		uint64_t v = load_word(bm, w) & valid_mask(bm, w);
+		bm->used += __builtin_popcountl(v);
+		summary_update(bm, w, v);
+	}
+	return true;
+}
+
+void bitmap_destroy(bitmap *bm)
+{
+	free(bm->segs);
+	free(bm->full);
+	free(bm->empty);
+	bm->segs = NULL;
+	bm->full = NULL;
+	bm->empty = NULL;
+}
+
+bool bitmap_test(const bitmap *bm, size_t i)
+{
+	return (word_at(bm, i / 64)[i % 64 / 8] & (1 << (7 - i % 8))) != 0;
+}
+
+size_t bitmap_count(const bitmap *bm, size_t from, size_t to)
+{
+	size_t count = 0;
+	while (from < to) {
+		size_t w = from / 64;
+		size_t end = ((to - w * 64) < 64) ? to - w * 64 : 64;
+		count += __builtin_popcountl(load_word(bm, w) & range_mask(from % 64, end));
+		from = w * 64 + end;
+	}
+	return count;
+}
+
+size_t bitmap_set_range(bitmap *bm, size_t start, size_t count)
+{
+	size_t end = start + count;
+	size_t changed = 0;
+
+	while (start < end) {
+		size_t w = start / 64;
+		size_t to = ((end - w * 64) < 64) ? end - w * 64 : 64;
+		uint64_t mask = range_mask(start % 64, to);
+		uint64_t old = load_word(bm, w);
+		uint64_t v = old | mask;
+		changed += __builtin_popcountl(v ^ old);
+		store_word(bm, w, v);
+		summary_update(bm, w, v);
+		start = w * 64 + to;
+	}
+	__atomic_add_fetch(&bm->used, changed, __ATOMIC_RELAXED);
+	return changed;
+}
+
+size_t bitmap_clear_range(bitmap *bm, size_t start, size_t count)
+{
+	size_t end = start + count;
+	size_t changed = 0;
+
+	while (start < end) {
+		size_t w = start / 64;
+		size_t to = ((end - w * 64) < 64) ? end - w * 64 : 64;
+		uint64_t mask = range_mask(start % 64, to);
+		uint64_t old = load_word(bm, w);
+		uint64_t v = old & ~mask;
+		changed += __builtin_popcountl(v ^ old);
+		store_word(bm, w, v);
+		summary_update(bm, w, v);
+		start = w * 64 + to;
+	}
+	__atomic_sub_fetch(&bm->used, changed, __ATOMIC_RELAXED);
+	return changed;
+}
+
+size_t bitmap_find_zero(const bitmap *bm, size_t from)
+{
+	return bitmap_find_zero_in(bm, from, bm->nbits);
+}
+
+size_t bitmap_find_zero_in(const bitmap *bm, size_t from, size_t to)
+{
+	if (to > bm->nbits) to = bm->nbits;
+	if (from >= to) return to;
+
+	// Partial first word: bits before from count as used
+	size_t w = from / 64;
+	size_t i = to;
+	uint64_t free_bits = ~(load_word(bm, w) | ~valid_mask(bm, w)) & (~0ul >> (from % 64));
+	if (free_bits != 0) {
+		i = w * 64 + __builtin_clzl(free_bits);
+	} else {
+		size_t end = (to + 63) / 64;
+		w = summary_find_clear(bm->full, w + 1, end);
+		if (w == end) return to;
+		free_bits = ~(load_word(bm, w) | ~valid_mask(bm, w));
+		i = w * 64 + __builtin_clzl(free_bits);
+	}
+	return (i < to) ? i : to;
+}
+
+size_t bitmap_find_one(const bitmap *bm, size_t from)
+{
+	if (from >= bm->nbits) return bm->nbits;
+
+	size_t w = from / 64;
+	uint64_t used_bits = load_word(bm, w) & valid_mask(bm, w) & (~0ul >> (from % 64));
+	if (used_bits != 0) {
+		return w * 64 + __builtin_clzl(used_bits);
+	}
+
+	w = summary_find_clear(bm->empty, w + 1, bm->nwords);
+	if (w == bm->nwords) return bm->nbits;
+	used_bits = load_word(bm, w) & valid_mask(bm, w);
+	return w * 64 + __builtin_clzl(used_bits);
+}
+
+size_t bitmap_find_run(const bitmap *bm, size_t from, size_t n)
+{
+	if (bm->nbits - __atomic_load_n(&bm->used, __ATOMIC_RELAXED) < n) return bm->nbits;
+
+	while (from < bm->nbits) {
+		size_t start = bitmap_find_zero(bm, from);
+		if (start == bm->nbits) break;
+		size_t end = bitmap_find_one(bm, start);
+		if (end - start >= n) return start;
+		from = end;
+	}
+	return bm->nbits;
+}
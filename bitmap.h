@@ -0,0 +1,125 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Bitmap engine header file.
+ *
+ * Operates on the on-disk inode and data bitmaps 64 bits at a time. Bits are
+ * numbered most significant bit first within each byte, matching the on-disk
+ * format written by mkfs. A bitmap may be stored in several equal segments that
+ * are not adjacent in the image (one per block group).
+ *
+ * Each bitmap has an in-memory two-level summary - one bit per 64-bit word
+ * telling whether the word is completely used or completely free - so that
+ * searches skip over full and empty regions 4096 bits at a time.
+ *
+ * Bits in different chunks of BITMAP_CHUNK_BITS share no state other than the
+ * count of used bits, which is updated atomically, so different threads may
+ * update different chunks without a common lock.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/** Number of bits covered by one summary word. */
+#define BITMAP_CHUNK_BITS (64 * 64)
+
+/** Runtime state of an on-disk bitmap. */
+typedef struct bitmap {
+	/** Pointers to the segments of the bitmap in the image. */
+	unsigned char **segs;
+	/** Number of 64-bit words in each segment. */
+	size_t seg_words;
+	/** Number of valid bits. */
+	size_t nbits;
+	/** Number of 64-bit words covering the valid bits. */
+	size_t nwords;
+	/** Number of set bits. Updated atomically. */
+	size_t used;
+	/** Summary: bit w is set if word w has no free bits. */
+	uint64_t *full;
+	/** Summary: bit w is set if word w has no used bits. */
+	uint64_t *empty;
+
+} bitmap;
+
+/**
+ * Initialize the runtime state of a bitmap and build its summary.
+ *
+ * Every segment but the last holds seg_bits bits; the last one must be
+ * readable up to a multiple of 8 bytes past nbits.
+ *
+ * @param bm        pointer to the bitmap state to initialize.
+ * @param segs      pointers to the segments of the bitmap in the image (copied).
+ * @param seg_bits  number of bits in a segment; a multiple of 256.
+ * @param nbits     number of valid bits.
+ * @return          true on success; false on failure (out of memory).
+ */
+bool bitmap_init(bitmap *bm, unsigned char *const *segs, size_t seg_bits, size_t nbits);
+
+/** Free the resources allocated in bitmap_init(). */
+void bitmap_destroy(bitmap *bm);
+
+/** Check if bit i is set. */
+bool bitmap_test(const bitmap *bm, size_t i);
+
+/** Count the set bits in [from, to). */
+size_t bitmap_count(const bitmap *bm, size_t from, size_t to);
+
+/**
+ * Set count bits starting at start.
+ *
+ * @return  number of bits that were previously clear.
+ */
+size_t bitmap_set_range(bitmap *bm, size_t start, size_t count);
+
+/**
+ * Clear count bits starting at start.
+ *
+ * @return  number of bits that were previously set.
+ */
+size_t bitmap_clear_range(bitmap *bm, size_t start, size_t count);
+
+/**
+ * Find the first clear bit at or after from.
+ *
+ * @return  index of the bit; nbits if there is none.
+ */
+size_t bitmap_find_zero(const bitmap *bm, size_t from);
+
+/**
+ * Find the first clear bit in [from, to). Doesn't look at the bits past to,
+ * which may belong to a chunk that another thread is updating.
+ *
+ * @return  index of the bit; to if there is none.
+ */
+size_t bitmap_find_zero_in(const bitmap *bm, size_t from, size_t to);
+
+/**
+ * Find the first set bit at or after from.
+ *
+ * @return  index of the bit; nbits if there is none.
+ */
+size_t bitmap_find_one(const bitmap *bm, size_t from);
+
+/**
+ * Find the first run of at least n clear bits starting at or after from.
+ *
+ * @return  index of the first bit of the run; nbits if there is none.
+ */
+size_t bitmap_find_run(const bitmap *bm, size_t from, size_t n);
@@ -0,0 +1,312 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Free space index implementation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "freespace.h"
+
+
+/** Tree selectors. */
+#define BY_ADDR 0
+#define BY_SIZE 1
+
+#define NODE(n)      (fsp->nodes[n])
+#define LEFT(t, n)   (fsp->nodes[n].link[t][0])
+#define RIGHT(t, n)  (fsp->nodes[n].link[t][1])
+
+
+/** Check if node n orders before the key (count, start) in tree t. */
+static inline bool node_before(const freespace *fsp, int t, uint32_t n, uint64_t count, uint64_t start)
+{
+	if (t == BY_SIZE && NODE(n).count != count) {
+		return NODE(n).count < count;
+	}
+	return NODE(n).start < start;
+}
+
+/** Recompute the subtree augmentation of node n in tree t. */
+static inline void update(freespace *fsp, int t, uint32_t n)
+{
+	if (t != BY_ADDR) return;
+
+	uint64_t m = NODE(n).count;
+	uint32_t l = LEFT(t, n), r = RIGHT(t, n);
+	if (l && NODE(l).max_count > m) m = NODE(l).max_count;
+	if (r && NODE(r).max_count > m) m = NODE(r).max_count;
+	NODE(n).max_count = m;
+}
+
+/** Split tree t rooted at n into nodes before the key (*l) and the rest (*r). */
+static void split(freespace *fsp, int t, uint32_t n, uint64_t count, uint64_t start,
+                  uint32_t *l, uint32_t *r)
+{
+	if (n == 0) {
+		*l = *r = 0;
+		return;
+	}
+	if (node_before(fsp, t, n, count, start)) {
+		split(fsp, t, RIGHT(t, n), count, start, &RIGHT(t, n), r);
+		*l = n;
+	} else {
+		split(fsp, t, LEFT(t, n), count, start, l, &LEFT(t, n));
+		*r = n;
+	}
+	update(fsp, t, n);
+}
+
+/** Merge trees l and r of tree t; all nodes of l order before all nodes of r. */
+static uint32_t merge(freespace *fsp, int t, uint32_t l, uint32_t r)
+{
+	if (l == 0) return r;
+	if (r == 0) return l;
+	if (NODE(l).prio > NODE(r).prio) {
+		RIGHT(t, l) = merge(fsp, t, RIGHT(t, l), r);
+		update(fsp, t, l);
+		return l;
+	}
+	LEFT(t, r) = merge(fsp, t, l, LEFT(t, r));
+	update(fsp, t, r);
+	return r;
+}
+
+static void tree_insert(freespace *fsp, int t, uint32_t n)
+{
+	uint32_t l, r;
+	split(fsp, t, fsp->root[t], NODE(n).count, NODE(n).start, &l, &r);
+	fsp->root[t] = merge(fsp, t, merge(fsp, t, l, n), r);
+}
+
+static void tree_delete(freespace *fsp, int t, uint32_t n)
+{
+	uint32_t l, m, r;
+	split(fsp, t, fsp->root[t], NODE(n).count, NODE(n).start, &l, &m);
+	split(fsp, t, m, NODE(n).count, NODE(n).start + 1, &m, &r);
+	fsp->root[t] = merge(fsp, t, l, r);
+}
+
+
+/** Take a node from the pool and insert it into both trees as [start, start + count). */
+static void node_insert(freespace *fsp, uint64_t start, uint64_t count)
+{
+	uint32_t n = fsp->unused;
+	if (n != 0) {
+		fsp->unused = LEFT(BY_ADDR, n);
+	} else {
+		n = ++fsp->allocated;
+	}
+
+	// xorshift32
+	fsp->seed ^= fsp->seed << 13;
+	fsp->seed ^= fsp->seed >> 17;
+	fsp->seed ^= fsp->seed << 5;
+
+	NODE(n).start = start;
+	NODE(n).count = count;
+	NODE(n).prio = fsp->seed;
+	NODE(n).max_count = count;
+	LEFT(BY_ADDR, n) = RIGHT(BY_ADDR, n) = 0;
+	LEFT(BY_SIZE, n) = RIGHT(BY_SIZE, n) = 0;
+	tree_insert(fsp, BY_ADDR, n);
+	tree_insert(fsp, BY_SIZE, n);
+	fsp->nextents++;
+	fsp->nfree += count;
+}
+
+/** Remove node n from both trees and return it to the pool. */
+static void node_delete(freespace *fsp, uint32_t n)
+{
+	tree_delete(fsp, BY_ADDR, n);
+	tree_delete(fsp, BY_SIZE, n);
+	fsp->nextents--;
+	fsp->nfree -= NODE(n).count;
+	LEFT(BY_ADDR, n) = fsp->unused;
+	fsp->unused = n;
+}
+
+/** Find the node with the largest start <= b; 0 if none. */
+static uint32_t floor_node(const freespace *fsp, uint64_t b)
+{
+	uint32_t n = fsp->root[BY_ADDR], res = 0;
+	while (n != 0) {
+		if (NODE(n).start <= b) {
+			res = n;
+			n = RIGHT(BY_ADDR, n);
+		} else {
+			n = LEFT(BY_ADDR, n);
+		}
+	}
+	return res;
+}
+
+/** Find the node with the smallest start >= b; 0 if none. */
+static uint32_t ceil_node(const freespace *fsp, uint64_t b)
+{
+	uint32_t n = fsp->root[BY_ADDR], res = 0;
+	while (n != 0) {
+		if (NODE(n).start >= b) {
+			res = n;
+			n = LEFT(BY_ADDR, n);
+		} else {
+			n = RIGHT(BY_ADDR, n);
+		}
+	}
+	return res;
+}
+
+/** Find the first node in address order with start >= goal and count >= need. */
+static uint32_t first_fit(const freespace *fsp, uint32_t n, uint64_t goal, uint64_t need)
+{
+	while ((n != 0) && (NODE(n).max_count >= need)) {
+		if (NODE(n).start < goal) {
+			n = RIGHT(BY_ADDR, n);
+			continue;
+		}
+		uint32_t res = first_fit(fsp, LEFT(BY_ADDR, n), goal, need);
+		if (res != 0) return res;
+		if (NODE(n).count >= need) return n;
+		n = RIGHT(BY_ADDR, n);
+	}
+	return 0;
+}
+
+
+bool freespace_init(freespace *fsp, const bitmap *bm, size_t from, size_t to)
+{
+	// Free extents are separated by used blocks, so there are at most
+	// (n + 1) / 2 of them in n blocks; node 0 is reserved as null
+	fsp->capacity = (to - from) / 2 + 2;
+	fsp->nodes = malloc((size_t)fsp->capacity * sizeof(freespace_node));
+	if (fsp->nodes == NULL) {
+		perror("malloc");
+		return false;
+	}
+	fsp->unused = 0;
+	fsp->allocated = 0;
+	fsp->root[BY_ADDR] = fsp->root[BY_SIZE] = 0;
+	fsp->nextents = 0;
+	fsp->nfree = 0;
+	fsp->seed = 2463534242u;
+
+	size_t start = bitmap_find_zero_in(bm, from, to);
+	while (start < to) {
+		size_t end = bitmap_find_one(bm, start);
+		if (end > to) end = to;
+		node_insert(fsp, start, end - start);
+		start = bitmap_find_zero_in(bm, end, to);
+	}
+	return true;
+}
+
+void freespace_destroy(freespace *fsp)
+{
+	free(fsp->nodes);
+	fsp->nodes = NULL;
+}
+
+void freespace_add(freespace *fsp, uint64_t start, uint64_t count)
+{
+	if (count == 0) return;
+
+	uint64_t end = start + count;
+
+	// Merge with a free extent that overlaps or ends right at start
+	uint32_t n = floor_node(fsp, start);
+	if ((n != 0) && (NODE(n).start + NODE(n).count >= start)) {
+		start = NODE(n).start;
+		if (NODE(n).start + NODE(n).count > end) end = NODE(n).start + NODE(n).count;
+		node_delete(fsp, n);
+	}
+	// ... and with the ones that overlap or begin right at end
+	while (((n = ceil_node(fsp, start)) != 0) && (NODE(n).start <= end)) {
+		if (NODE(n).start + NODE(n).count > end) end = NODE(n).start + NODE(n).count;
+		node_delete(fsp, n);
+	}
+	node_insert(fsp, start, end - start);
+}
+
+void freespace_remove(freespace *fsp, uint64_t start, uint64_t count)
+{
+	if (count == 0) return;
+
+	uint64_t end = start + count;
+	for (;;) {
+		uint32_t n = floor_node(fsp, start);
+		if ((n == 0) || (NODE(n).start + NODE(n).count <= start)) {
+			n = ceil_node(fsp, start);
+			if ((n == 0) || (NODE(n).start >= end)) break;
+		}
+
+		uint64_t n_start = NODE(n).start;
+		uint64_t n_end = n_start + NODE(n).count;
+		node_delete(fsp, n);
+		if (n_start < start) node_insert(fsp, n_start, start - n_start);
+		if (n_end > end) node_insert(fsp, end, n_end - end);
+	}
+}
+
+bool freespace_best_fit(const freespace *fsp, uint64_t n, uint64_t *start, uint64_t *count)
+{
+	// Smallest (count, start) with count >= n
+	uint32_t cur = fsp->root[BY_SIZE], res = 0;
+	while (cur != 0) {
+		if (NODE(cur).count >= n) {
+			res = cur;
+			cur = LEFT(BY_SIZE, cur);
+		} else {
+			cur = RIGHT(BY_SIZE, cur);
+		}
+	}
+	if (res == 0) return false;
+	*start = NODE(res).start;
+	*count = NODE(res).count;
+	return true;
+}
+
+bool freespace_near_fit(const freespace *fsp, uint64_t goal, uint64_t n, uint64_t *start, uint64_t *count)
+{
+	uint64_t avail = freespace_free_at(fsp, goal);
+	if (avail >= n) {
+		*start = goal;
+		*count = avail;
+		return true;
+	}
+
+	uint32_t res = first_fit(fsp, fsp->root[BY_ADDR], goal, n);
+	if (res == 0) return false;
+	*start = NODE(res).start;
+	*count = NODE(res).count;
+	return true;
+}
+
+bool freespace_largest(const freespace *fsp, uint64_t *start, uint64_t *count)
+{
+	uint32_t n = fsp->root[BY_SIZE];
+	if (n == 0) return false;
+	while (RIGHT(BY_SIZE, n) != 0) n = RIGHT(BY_SIZE, n);
+	*start = NODE(n).start;
+	*count = NODE(n).count;
+	return true;
+}
+
+uint64_t freespace_free_at(const freespace *fsp, uint64_t b)
+{
+	uint32_t n = floor_node(fsp, b);
+	if ((n == 0) || (NODE(n).start + NODE(n).count <= b)) return 0;
+	return NODE(n).start + NODE(n).count - b;
+}
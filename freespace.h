@@ -0,0 +1,120 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Free space index header file.
+ *
+ * Keeps the free extents of the data region in two balanced trees (treaps)
+ * that share their nodes: one ordered by address and one ordered by size.
+ * The index mirrors the data bitmap and is updated incrementally whenever
+ * data blocks are allocated or freed, so allocation never scans the bitmap.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bitmap.h"
+
+
+/** Free extent - a node of both trees. Nodes are referenced by index; 0 is null. */
+typedef struct freespace_node {
+	/** First free block. */
+	uint64_t start;
+	/** Number of free blocks. */
+	uint64_t count;
+	/** Child links: [tree][0 - left, 1 - right]. */
+	uint32_t link[2][2];
+	/** Heap priority (shared by both trees). */
+	uint32_t prio;
+	/** Largest count in the address-ordered subtree rooted at this node. */
+	uint64_t max_count;
+
+} freespace_node;
+
+/** Free space index. */
+typedef struct freespace {
+	/** Node pool, sized for the worst case at init so updates never allocate. */
+	freespace_node *nodes;
+	/** Number of nodes in the pool. */
+	uint32_t capacity;
+	/** Head of the list of unused nodes (linked through link[0][0]). */
+	uint32_t unused;
+	/** Number of pool nodes handed out so far (including freed ones). */
+	uint32_t allocated;
+	/** Roots of the address-ordered (0) and size-ordered (1) trees. */
+	uint32_t root[2];
+	/** Number of free extents. */
+	uint64_t nextents;
+	/** Total number of free blocks. */
+	uint64_t nfree;
+	/** State of the priority generator. */
+	uint32_t seed;
+
+} freespace;
+
+/**
+ * Build the free space index of a range of blocks from a bitmap.
+ *
+ * @param fsp   pointer to the index to initialize.
+ * @param bm    bitmap whose clear bits are free blocks.
+ * @param from  first block of the range.
+ * @param to    end of the range (exclusive); at most bm->nbits.
+ * @return      true on success; false on failure (out of memory).
+ */
+bool freespace_init(freespace *fsp, const bitmap *bm, size_t from, size_t to);
+
+/** Free the resources allocated in freespace_init(). */
+void freespace_destroy(freespace *fsp);
+
+/**
+ * Record that blocks [start, start + count) are now free. The range may
+ * overlap or touch existing free extents; they are merged.
+ */
+void freespace_add(freespace *fsp, uint64_t start, uint64_t count);
+
+/**
+ * Record that blocks [start, start + count) are now in use. Parts of the
+ * range that are not free are ignored.
+ */
+void freespace_remove(freespace *fsp, uint64_t start, uint64_t count);
+
+/**
+ * Find the smallest free extent with at least n blocks.
+ *
+ * @return  true if found (start and count receive the extent); false otherwise.
+ */
+bool freespace_best_fit(const freespace *fsp, uint64_t n, uint64_t *start, uint64_t *count);
+
+/**
+ * Find the first free extent with at least n blocks that starts at or after
+ * goal, or that contains goal (in which case start is set to goal and count
+ * to the number of free blocks from goal on).
+ *
+ * @return  true if found; false otherwise.
+ */
+bool freespace_near_fit(const freespace *fsp, uint64_t goal, uint64_t n, uint64_t *start, uint64_t *count);
+
+/**
+ * Find the largest free extent.
+ *
+ * @return  true if there is any free space; false otherwise.
+ */
+bool freespace_largest(const freespace *fsp, uint64_t *start, uint64_t *count);
+
+/**
+ * Get the number of free blocks starting at block b (0 if b is in use).
+ */
+uint64_t freespace_free_at(const freespace *fsp, uint64_t b);
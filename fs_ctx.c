@@ -16,27 +16,359 @@
  * CSC369 Assignment 1 - File system runtime context implementation.
  */
 
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "fs_ctx.h"
 #include "a1fs.h"
+#include "util.h"
+
+
+/**
+ * Check that the block group layout described by the superblock is sane for
+ * allocation clusters of 2^cluster_bits blocks.
+ */
+static bool layout_valid(const a1fs_superblock *sp, size_t size, unsigned int cluster_bits)
+{
+	uint64_t ngroups = sp->s_groups_count;
+	return (ngroups != 0) &&
+	       (sp->s_blocks_per_group != 0) &&
+	       (sp->s_blocks_per_group <= (uint64_t)A1FS_BLOCKS_PER_GROUP << cluster_bits) &&
+	       (sp->s_blocks_per_group % (256u << cluster_bits) == 0) &&
+	       (sp->s_blocks_count % (1u << cluster_bits) == 0) &&
+	       (sp->s_inodes_per_group != 0) && (sp->s_inodes_per_group <= A1FS_BLOCKS_PER_GROUP) &&
+	       (sp->s_inodes_per_group % 256 == 0) &&
+	       (sp->s_inodes_count == ngroups * sp->s_inodes_per_group) &&
+	       ((ngroups - 1) * sp->s_blocks_per_group < sp->s_blocks_count) &&
+	       (sp->s_blocks_count <= ngroups * sp->s_blocks_per_group) &&
+	       (sp->s_blocks_count <= size / A1FS_BLOCK_SIZE) &&
+	       (sp->s_first_data_block == 0) && (sp->datablocks_count == sp->s_blocks_count) &&
+	       (sp->s_group_desc_blk * A1FS_BLOCK_SIZE + ngroups * sizeof(a1fs_group_desc) <= size);
+}
+
+/**
+ * Set up the runtime state of the inode and data bitmaps, whose segments are
+ * spread over the block groups, and recompute the free counts of the groups.
+ *
+ * @return  true on success; false on failure (out of memory).
+ */
+static bool bitmaps_init(fs_ctx *fs)
+{
+	a1fs_superblock *sp = (a1fs_superblock *)(fs->image);
+	unsigned int ngroups = sp->s_groups_count;
+
+	unsigned char **inode_segs = malloc(ngroups * sizeof(unsigned char *));
+	unsigned char **data_segs = malloc(ngroups * sizeof(unsigned char *));
+	if ((inode_segs == NULL) || (data_segs == NULL)) {
+		perror("malloc");
+		free(inode_segs);
+		free(data_segs);
+		return false;
+	}
+	for (unsigned int g = 0; g < ngroups; g++) {
+		inode_segs[g] = fs->image + (size_t)fs->gd[g].inode_bitmap * A1FS_BLOCK_SIZE;
+		data_segs[g] = fs->image + (size_t)fs->gd[g].block_bitmap * A1FS_BLOCK_SIZE;
+	}
+
+	bool ok = bitmap_init(&fs->inode_bm, inode_segs, sp->s_inodes_per_group, sp->s_inodes_count);
+	if (ok && !bitmap_init(&fs->data_bm, data_segs, sp->s_blocks_per_group >> fs->cluster_bits,
+	                       sp->s_blocks_count >> fs->cluster_bits)) {
+		bitmap_destroy(&fs->inode_bm);
+		ok = false;
+	}
+	free(inode_segs);
+	free(data_segs);
+	if (!ok) return false;
+
+	size_t cpg = sp->s_blocks_per_group >> fs->cluster_bits;
+	for (unsigned int g = 0; g < ngroups; g++) {
+		size_t first = (size_t)g * cpg;
+		size_t end = (first + cpg < fs->data_bm.nbits) ? first + cpg : fs->data_bm.nbits;
+		fs->gd[g].free_blocks = ((end - first) - bitmap_count(&fs->data_bm, first, end)) << fs->cluster_bits;
+		first = (size_t)g * sp->s_inodes_per_group;
+		end = first + sp->s_inodes_per_group;
+		fs->gd[g].free_inodes = (end - first) - bitmap_count(&fs->inode_bm, first, end);
+	}
+	return true;
+}
+
+/**
+ * Split a bitmap into allocation groups of whole chunks, at most
+ * A1FS_MAX_GROUPS of them.
+ *
+ * @param groups   pointer to the variable that receives the array of groups.
+ * @param ngroups  pointer to the variable that receives the number of groups.
+ * @param bm       the bitmap.
+ * @param data     true to build the free space index of each group.
+ * @return         true on success; false on failure (out of memory).
+ */
+static bool groups_init(alloc_group **groups, unsigned int *ngroups, const bitmap *bm, bool data)
+{
+	size_t per_group = (bm->nbits + A1FS_MAX_GROUPS - 1) / A1FS_MAX_GROUPS;
+	size_t size = align_up((per_group != 0) ? per_group : 1, BITMAP_CHUNK_BITS);
+	unsigned int n = (bm->nbits + size - 1) / size;
+	if (n == 0) n = 1;
 
+	*groups = calloc(n, sizeof(alloc_group));
+	if (*groups == NULL) {
+		perror("calloc");
+		return false;
+	}
+	for (unsigned int i = 0; i < n; i++) {
+		alloc_group *g = &(*groups)[i];
+		g->first = (uint64_t)i * size;
+		g->count = (g->first + size <= bm->nbits) ? size : bm->nbits - g->first;
+		pthread_mutex_init(&g->lock, NULL);
+		*ngroups = i + 1;
+		if (data && !freespace_init(&g->freespace, bm, g->first, g->first + g->count)) {
+			return false;
+		}
+	}
+	return true;
+}
 
-bool fs_ctx_init(fs_ctx *fs, void *image, size_t size)
+/** Free the resources allocated in groups_init(). */
+static void groups_destroy(alloc_group **groups, unsigned int *ngroups)
+{
+	if (*groups == NULL) return;
+	for (unsigned int i = 0; i < *ngroups; i++) {
+		pthread_mutex_destroy(&(*groups)[i].lock);
+		freespace_destroy(&(*groups)[i].freespace);
+	}
+	free(*groups);
+	*groups = NULL;
+	*ngroups = 0;
+}
+
+
+bool fs_ctx_init(fs_ctx *fs, void *image, size_t size, a1fs_opts *opts)
 {
 	fs->image = image;
 	fs->size = size;
+	fs->opts = opts;
 
 	//TODO: check if the file system image can be mounted and initialize its
 	// runtime state
 	
-	const struct a1fs_superblock *sp = (const struct a1fs_superblock *)(image);
-	if (sp->magic == 0xC5C369A1C5C369A1ul) {
-  		return true;
+	struct a1fs_superblock *sp = (struct a1fs_superblock *)(image);
+	if (sp->magic != A1FS_MAGIC) {
+		return false;
+	}
+
+	if (sp->s_features & ~A1FS_FEATURES_SUPPORTED) {
+		fprintf(stderr, "Unsupported file system features: %#x\n", sp->s_features & ~A1FS_FEATURES_SUPPORTED);
+		return false;
+	}
+
+	if (!(sp->s_features & A1FS_FEATURE_BLOCK_GROUPS) || !(sp->s_features & A1FS_FEATURE_64BIT)) {
+		fprintf(stderr, "The image predates block groups or 64-bit block numbers; it must be reformatted\n");
+		return false;
 	}
-	return false;
+	fs->cluster_bits = 0;
+	if (sp->s_features & A1FS_FEATURE_BIGALLOC) {
+		if (sp->s_log_cluster_size > A1FS_MAX_LOG_CLUSTER_SIZE) {
+			fprintf(stderr, "Unsupported cluster size: 2^%u blocks\n", sp->s_log_cluster_size);
+			return false;
+		}
+		fs->cluster_bits = sp->s_log_cluster_size;
+	}
+	if (!layout_valid(sp, size, fs->cluster_bits)) {
+		fprintf(stderr, "Invalid block group layout\n");
+		return false;
+	}
+	fs->gd = image + (size_t)sp->s_group_desc_blk * A1FS_BLOCK_SIZE;
+	if (!bitmaps_init(fs)) {
+		return false;
+	}
+	fs->inode_groups = fs->data_groups = NULL;
+	fs->inode_ngroups = fs->data_ngroups = 0;
+	if (!groups_init(&fs->inode_groups, &fs->inode_ngroups, &fs->inode_bm, false) ||
+	    !groups_init(&fs->data_groups, &fs->data_ngroups, &fs->data_bm, true)) {
+		groups_destroy(&fs->inode_groups, &fs->inode_ngroups);
+		groups_destroy(&fs->data_groups, &fs->data_ngroups);
+		bitmap_destroy(&fs->inode_bm);
+		bitmap_destroy(&fs->data_bm);
+		return false;
+	}
+	fs->next_home = 0;
+	memset(fs->resv, 0, sizeof(fs->resv));
+	fs->resv_blocks = 0;
+	memset(fs->cursor, 0, sizeof(fs->cursor));
+
+	// The usage counters are derived from the bitmaps
+	sp->inodes_usd = fs->inode_bm.used;
+	sp->blocks_usd = (sp->s_blocks_count - sp->datablocks_count) + (fs->data_bm.used << fs->cluster_bits);
+
+	fs->dcache_size = A1FS_DCACHE_SIZE;
+	if (opts->dcache_size != 0) {
+		// Round up to a power of 2 so that the slot can be taken with a mask
+		fs->dcache_size = 1;
+		while (fs->dcache_size < opts->dcache_size) fs->dcache_size <<= 1;
+	}
+	fs->dcache = calloc(fs->dcache_size, sizeof(dcache_entry));
+	if (fs->dcache == NULL) {
+		perror("calloc");
+		groups_destroy(&fs->inode_groups, &fs->inode_ngroups);
+		groups_destroy(&fs->data_groups, &fs->data_ngroups);
+		bitmap_destroy(&fs->inode_bm);
+		bitmap_destroy(&fs->data_bm);
+		return false;
+	}
+	fs->dcache_hits = 0;
+	fs->dcache_misses = 0;
+
+	fs->inode_locks = malloc(sp->s_inodes_count * sizeof(pthread_rwlock_t));
+	fs->extent_gen = calloc(sp->s_inodes_count, sizeof(uint32_t));
+	fs->open_count = calloc(sp->s_inodes_count, sizeof(uint32_t));
+	if ((fs->inode_locks == NULL) || (fs->extent_gen == NULL) || (fs->open_count == NULL)) {
+		perror("malloc");
+		free(fs->inode_locks);
+		free(fs->extent_gen);
+		free(fs->open_count);
+		fs->inode_locks = NULL;
+		fs->extent_gen = NULL;
+		fs->open_count = NULL;
+		free(fs->dcache);
+		fs->dcache = NULL;
+		groups_destroy(&fs->inode_groups, &fs->inode_ngroups);
+		groups_destroy(&fs->data_groups, &fs->data_ngroups);
+		bitmap_destroy(&fs->inode_bm);
+		bitmap_destroy(&fs->data_bm);
+		return false;
+	}
+	for (unsigned int i = 0; i < sp->s_inodes_count; i++) {
+		pthread_rwlock_init(&fs->inode_locks[i], NULL);
+	}
+	pthread_mutex_init(&fs->resv_lock, NULL);
+	pthread_mutex_init(&fs->cursor_lock, NULL);
+	pthread_mutex_init(&fs->dcache_lock, NULL);
+	return true;
 }
 
 void fs_ctx_destroy(fs_ctx *fs)
 {
 	//TODO: cleanup any resources allocated in fs_ctx_init()
+	if (fs->dcache != NULL) {
+		if (fs->opts->dcache_stats) {
+			fprintf(stderr, "a1fs: lookup cache: %zu slots, %" PRIu64 " hits, %" PRIu64 " misses\n",
+			        fs->dcache_size, fs->dcache_hits, fs->dcache_misses);
+		}
+		for (size_t i = 0; i < fs->dcache_size; i++) {
+			free(fs->dcache[i].path);
+		}
+		free(fs->dcache);
+		fs->dcache = NULL;
+	}
+	if (fs->inode_locks != NULL) {
+		// The image may be unmapped already; there is a lock per inode bitmap bit
+		for (size_t i = 0; i < fs->inode_bm.nbits; i++) {
+			pthread_rwlock_destroy(&fs->inode_locks[i]);
+		}
+		free(fs->inode_locks);
+		fs->inode_locks = NULL;
+		free(fs->extent_gen);
+		fs->extent_gen = NULL;
+		free(fs->open_count);
+		fs->open_count = NULL;
+		pthread_mutex_destroy(&fs->resv_lock);
+		pthread_mutex_destroy(&fs->cursor_lock);
+		pthread_mutex_destroy(&fs->dcache_lock);
+	}
+	groups_destroy(&fs->inode_groups, &fs->inode_ngroups);
+	groups_destroy(&fs->data_groups, &fs->data_ngroups);
+	bitmap_destroy(&fs->inode_bm);
+	bitmap_destroy(&fs->data_bm);
 	fs->image = (void *)0xC00;
 }
+
+
+/** FNV-1a hash of a path. Never returns 0 (used to mark unused slots). */
+static uint64_t dcache_hash(const char *path)
+{
+	uint64_t h = 0xcbf29ce484222325ul;
+	for (const unsigned char *c = (const unsigned char *)path; *c; c++) {
+		h ^= *c;
+		h *= 0x100000001b3ul;
+	}
+	return (h == 0) ? 1 : h;
+}
+
+/** Get the cache slot for a path hash. */
+static dcache_entry *dcache_slot(fs_ctx *fs, uint64_t hash)
+{
+	assert(is_powerof2(fs->dcache_size));
+	return &fs->dcache[hash & (fs->dcache_size - 1)];
+}
+
+void inode_rdlock(fs_ctx *fs, a1fs_ino_t ino)
+{
+	pthread_rwlock_rdlock(&fs->inode_locks[ino]);
+}
+
+void inode_wrlock(fs_ctx *fs, a1fs_ino_t ino)
+{
+	pthread_rwlock_wrlock(&fs->inode_locks[ino]);
+}
+
+void inode_unlock(fs_ctx *fs, a1fs_ino_t ino)
+{
+	pthread_rwlock_unlock(&fs->inode_locks[ino]);
+}
+
+
+bool dcache_lookup(fs_ctx *fs, const char *path, a1fs_ino_t *ino, bool *negative)
+{
+	uint64_t hash = dcache_hash(path);
+	pthread_mutex_lock(&fs->dcache_lock);
+	dcache_entry *e = dcache_slot(fs, hash);
+
+	if ((e->hash != hash) || (strcmp(e->path, path) != 0)) {
+		fs->dcache_misses++;
+		pthread_mutex_unlock(&fs->dcache_lock);
+		return false;
+	}
+	fs->dcache_hits++;
+	*ino = e->ino;
+	*negative = e->negative;
+	pthread_mutex_unlock(&fs->dcache_lock);
+	return true;
+}
+
+void dcache_insert(fs_ctx *fs, const char *path, a1fs_ino_t ino, bool negative)
+{
+	uint64_t hash = dcache_hash(path);
+	pthread_mutex_lock(&fs->dcache_lock);
+	dcache_entry *e = dcache_slot(fs, hash);
+
+	// Reuse the previous occupant's buffer when the new path fits into it
+	size_t len = strlen(path);
+	if ((e->path == NULL) || (strlen(e->path) < len)) {
+		char *copy = realloc(e->path, len + 1);
+		if (copy == NULL) {
+			// Not caching is always safe
+			e->hash = 0;
+			pthread_mutex_unlock(&fs->dcache_lock);
+			return;
+		}
+		e->path = copy;
+	}
+	memcpy(e->path, path, len + 1);
+	e->hash = hash;
+	e->ino = ino;
+	e->negative = negative;
+	pthread_mutex_unlock(&fs->dcache_lock);
+}
+
+void dcache_invalidate(fs_ctx *fs, const char *path)
+{
+	uint64_t hash = dcache_hash(path);
+	pthread_mutex_lock(&fs->dcache_lock);
+	dcache_entry *e = dcache_slot(fs, hash);
+
+	if ((e->hash == hash) && (strcmp(e->path, path) == 0)) {
+		e->hash = 0;
+	}
+	pthread_mutex_unlock(&fs->dcache_lock);
+}
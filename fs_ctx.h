@@ -18,22 +18,185 @@
 
 #pragma once
 
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 
+#include "a1fs.h"
+#include "bitmap.h"
+#include "freespace.h"
 #include "options.h"
 
 
+/** Feature flags (A1FS_FEATURE_*) this implementation can mount. */
+#define A1FS_FEATURES_SUPPORTED (A1FS_FEATURE_VAR_DENTRY | A1FS_FEATURE_BLOCK_GROUPS | A1FS_FEATURE_64BIT | \
+                                 A1FS_FEATURE_BIGALLOC)
+
+/** Default number of slots in the path lookup cache. */
+#define A1FS_DCACHE_SIZE 4096
+
+/**
+ * Path lookup cache entry.
+ *
+ * Positive entries map a path to its inode number. Negative entries record
+ * that the last component of a path does not exist in its (existing) parent
+ * directory, so that repeated lookups of missing files don't rescan it.
+ */
+typedef struct dcache_entry {
+	/** Hash of the path; 0 marks an unused slot. */
+	uint64_t hash;
+	/** Null-terminated copy of the path (heap allocated). */
+	char *path;
+	/** Inode number the path resolves to (positive entries only). */
+	a1fs_ino_t ino;
+	/** true if the path is known not to exist. */
+	bool negative;
+
+} dcache_entry;
+
+/** Largest number of allocation groups a bitmap is split into. */
+#define A1FS_MAX_GROUPS 64
+
+/**
+ * Allocation group: a slice of the inode or data bitmap with its own lock, so
+ * that threads allocating from different groups don't contend. Groups start
+ * at multiples of BITMAP_CHUNK_BITS and so share no bitmap state. Each thread
+ * has a home group that it allocates from first; it only takes from the other
+ * groups when its own is busy or out of space.
+ */
+typedef struct alloc_group {
+	/** Protects the bits of the group and its free space index. */
+	pthread_mutex_t lock;
+	/** First bit of the group. */
+	uint64_t first;
+	/** Number of bits in the group. */
+	uint64_t count;
+	/** Free extents of the group (data groups only). */
+	freespace freespace;
+
+} alloc_group;
+
+/** Number of slots in the table of append reservations. */
+#define A1FS_RESV_SLOTS 64
+
+/** Largest number of blocks reserved ahead of an appending file. */
+#define A1FS_RESV_MAX 64
+
+/**
+ * Append reservation: free clusters right after the last extent of a file that
+ * are kept out of the free space index (but stay clear in the data bitmap), so
+ * that the next appends can grow the extent in place even when other files are
+ * being written at the same time. Reservations only exist in memory.
+ */
+typedef struct resv_entry {
+	/** Inode number of the file. */
+	a1fs_ino_t ino;
+	/** Number of reserved clusters; 0 marks an unused slot. */
+	uint32_t count;
+	/** First reserved cluster. */
+	uint64_t start;
+
+} resv_entry;
+
+/** Number of slots in the table of extent lookup cursors. */
+#define A1FS_CURSOR_SLOTS 64
+
+/**
+ * Extent lookup cursor: the extent of a file that was accessed last. Lets
+ * sequential reads and writes within an extent skip the extent tree lookup.
+ * Besides the shared table of cursors, each open file has a cursor of its own
+ * (pointed to by its file handle).
+ */
+typedef struct extent_cursor {
+	/** Inode number of the file. */
+	a1fs_ino_t ino;
+	/** Extent tree generation of the file the extent was found in. */
+	uint32_t gen;
+	/** The extent; a count of 0 marks an unused slot. */
+	a1fs_extent_leaf leaf;
+
+} extent_cursor;
+
 /**
  * Mounted file system runtime state - "fs context".
+ *
+ * The file system may serve requests from several threads. The locks below
+ * must be taken in this order:
+ *   1. inode locks - a reader/writer lock per inode, covering its attributes
+ *      and data; for a directory, also its entries and hashed index. The lock
+ *      of a directory is taken before the locks of its children.
+ *   2. resv_lock - the append reservations.
+ *   3. allocation group locks - the bits of a group of the inode or data
+ *      bitmap and the free extents of a data group; only one at a time.
+ *   4. cursor_lock, dcache_lock - the extent lookup cursors and the path
+ *      lookup cache; nothing else is locked while holding them.
+ * The usage counters in the superblock are updated atomically.
  */
 typedef struct fs_ctx {
 	/** Pointer to the start of the image. */
 	void *image;
 	/** Image size in bytes. */
 	size_t size;
+	/** Descriptor of the image file, for splicing data to and from it. */
+	int image_fd;
+	/** Command line options the file system was mounted with. */
+	const a1fs_opts *opts;
+
+	/** Block group descriptor table in the image. */
+	a1fs_group_desc *gd;
+	/** Inode bitmap state (one bit per inode; a segment per block group). */
+	bitmap inode_bm;
+	/** Data bitmap state (one bit per cluster; a segment per block group). */
+	bitmap data_bm;
+	/** Log2 of the number of blocks in an allocation cluster (0 without bigalloc). */
+	unsigned int cluster_bits;
+	/** Allocation groups of the inode bitmap. */
+	alloc_group *inode_groups;
+	/** Number of inode allocation groups. */
+	unsigned int inode_ngroups;
+	/** Allocation groups of the data bitmap; their free extents are kept in sync with data_bm. */
+	alloc_group *data_groups;
+	/** Number of data allocation groups. */
+	unsigned int data_ngroups;
+	/** Number of home groups handed out to threads so far. */
+	unsigned int next_home;
+	/** Append reservations; a direct-mapped table indexed by inode number. */
+	resv_entry resv[A1FS_RESV_SLOTS];
+	/** Total number of reserved clusters. */
+	uint64_t resv_blocks;
+	/** Extent lookup cursors; a direct-mapped table indexed by inode number. */
+	extent_cursor cursor[A1FS_CURSOR_SLOTS];
 
-	//TODO: useful runtime state of the mounted file system should be cached
-	// here (NOT in global variables in a1fs.c)
+	/** Inode locks, indexed by inode number. */
+	pthread_rwlock_t *inode_locks;
+	/**
+	 * Extent tree generations, indexed by inode number; bumped (under the
+	 * inode lock) whenever the extent tree of the file changes, which makes
+	 * all of its extent lookup cursors stale.
+	 */
+	uint32_t *extent_gen;
+	/**
+	 * Number of open handles of each inode, indexed by inode number;
+	 * protected by the inode locks. A directory isn't compacted while it is
+	 * open (see dir_tidy()). In the path-based driver, which counts files as
+	 * well, an unlinked file is only freed once its last handle is released.
+	 */
+	uint32_t *open_count;
+	/** Protects the append reservations. */
+	pthread_mutex_t resv_lock;
+	/** Protects the extent lookup cursors. */
+	pthread_mutex_t cursor_lock;
+	/** Protects the path lookup cache and its counters. */
+	pthread_mutex_t dcache_lock;
+
+	/** Path lookup cache; a direct-mapped table indexed by path hash. */
+	dcache_entry *dcache;
+	/** Number of slots in the lookup cache (a power of 2). */
+	size_t dcache_size;
+	/** Number of lookups served from the cache. */
+	uint64_t dcache_hits;
+	/** Number of lookups that had to scan directories. */
+	uint64_t dcache_misses;
 
 } fs_ctx;
 
@@ -43,9 +206,10 @@ typedef struct fs_ctx {
  * @param fs     pointer to the context to initialize.
  * @param image  pointer to the start of the image.
  * @param size   image size in bytes.
+ * @param opts   command line options.
  * @return       true on success; false on failure (e.g. invalid superblock).
  */
-bool fs_ctx_init(fs_ctx *fs, void *image, size_t size);
+bool fs_ctx_init(fs_ctx *fs, void *image, size_t size, a1fs_opts *opts);
 
 /**
  * Destroy file system context.
@@ -53,3 +217,50 @@ bool fs_ctx_init(fs_ctx *fs, void *image, size_t size);
  * Must cleanup all the resources created in fs_ctx_init().
  */
 void fs_ctx_destroy(fs_ctx *fs);
+
+/** Lock an inode for reading. */
+void inode_rdlock(fs_ctx *fs, a1fs_ino_t ino);
+
+/** Lock an inode for writing. */
+void inode_wrlock(fs_ctx *fs, a1fs_ino_t ino);
+
+/** Unlock an inode locked with inode_rdlock() or inode_wrlock(). */
+void inode_unlock(fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * Look up a path in the lookup cache.
+ *
+ * Updates the hit/miss counters.
+ *
+ * @param fs        file system context.
+ * @param path      absolute path.
+ * @param ino       pointer to the variable that receives the inode number.
+ * @param negative  pointer to the variable that is set to true if the path is
+ *                  cached as nonexistent.
+ * @return          true if the path was found in the cache; false otherwise.
+ */
+bool dcache_lookup(fs_ctx *fs, const char *path, a1fs_ino_t *ino, bool *negative);
+
+/**
+ * Insert a path into the lookup cache, replacing whatever occupied its slot.
+ *
+ * The caller must hold the lock of the parent directory of the path, so that
+ * the entry can't be made stale by a concurrent change to the directory.
+ *
+ * @param fs        file system context.
+ * @param path      absolute path.
+ * @param ino       inode number the path resolves to (ignored if negative).
+ * @param negative  true if the path does not exist.
+ */
+void dcache_insert(fs_ctx *fs, const char *path, a1fs_ino_t ino, bool negative);
+
+/**
+ * Drop the cache entry for a path (if any).
+ *
+ * Must be called whenever a directory entry is added or removed, with the
+ * lock of the directory held for writing.
+ *
+ * @param fs    file system context.
+ * @param path  absolute path.
+ */
+void dcache_invalidate(fs_ctx *fs, const char *path);
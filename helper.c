@@ -1,522 +1,2576 @@
 #include "a1fs.h"
+#include "bitmap.h"
+#include "fs_ctx.h"
+#include "map.h"
+#include "util.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/statvfs.h>
 #include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
 
 
 
-/**
- * Return an array of potential extent structs. since the operation uses dynamic allocation. Maker sure
- * to free the memory later.
- *
- * @param image   pointer points to the start of the image file.
- * @param sp      a1fs_superblock of the image file.
- * @param extent_count  pointer to the integer that receives the number of extent structs in the returned array.
- * 
- * @return        struct a1fs_extent *
- */
-struct a1fs_extent *find_free_extents(void *image, struct a1fs_superblock *sp, int *extent_count) {
+/** Get the runtime state of the inode bitmap (bitmap == 1) or the data bitmap (bitmap == 0). */
+bitmap *get_bitmap(fs_ctx *fs, int bitmap) {
+    return bitmap ? &fs->inode_bm : &fs->data_bm;
+}
+
+
+/** Get a pointer to a data block by its block number. */
+void *block_at(fs_ctx *fs, a1fs_blk_t blk) {
+    struct a1fs_superblock *sp = (struct a1fs_superblock *)(fs->image);
+    return fs->image + (size_t)(sp->s_first_data_block + blk) * A1FS_BLOCK_SIZE;
+}
 
-	struct a1fs_extent *free_extents = malloc(sp->datablocks_count * sizeof(struct a1fs_extent));
 
-    unsigned char *data_bits = (unsigned char *)(image + sp->data_bitmap_pt);
+/** Home allocation group of the calling thread plus 1; 0 until one is handed out. */
+static __thread unsigned int thread_home_group;
 
-	int bits = sp->datablocks_count;
+/** Get the index of the home allocation group of the calling thread among ngroups groups. */
+unsigned int thread_home(fs_ctx *fs, unsigned int ngroups) {
+    if (thread_home_group == 0) {
+        thread_home_group = __atomic_add_fetch(&fs->next_home, 1, __ATOMIC_RELAXED);
+    }
+    return (thread_home_group - 1) % ngroups;
+}
 
-	//number of extents in free_extents.
-    *extent_count = 0;
 
-    bool activate = false;
-    int block_count = 0;
-    int start = 0;
+/** Get the number of blocks in an allocation cluster. */
+uint64_t cluster_blocks(fs_ctx *fs) {
+    return (uint64_t)1 << fs->cluster_bits;
+}
+
 
-    for (int i = 0; i < bits; i++) {
+/** Get the number of clusters needed for n blocks. */
+uint64_t blocks_to_clusters(fs_ctx *fs, uint64_t n) {
+    return (n + cluster_blocks(fs) - 1) >> fs->cluster_bits;
+}
 
-        int index_a = i/8;
-		int index_b = i%8;
-		int left_shift = 7 - index_b;
 
-        // check if bit is 0 or 1
-        if ((data_bits[index_a] & (1 << left_shift)) == 0) {
-            if (i == (bits-1)) {
-                free_extents[*extent_count].start = start;
-                free_extents[*extent_count].count = block_count+1;
-                *extent_count = *extent_count + 1;
-            }
-            else if (activate) {
-                block_count++;
-            }
-            else {
-                activate = true;
-                block_count++;
-                start = i;
-            }
+/** Get the index of the allocation group of a cluster of the data region. */
+unsigned int data_group_index(fs_ctx *fs, uint64_t cluster) {
+    // All groups but the last one have the size of the first
+    return cluster / fs->data_groups[0].count;
+}
+
+
+/** Get the allocation group of a cluster of the data region. */
+alloc_group *data_group(fs_ctx *fs, uint64_t cluster) {
+    return &fs->data_groups[data_group_index(fs, cluster)];
+}
+
+
+/**
+ * Call fn on each allocation group of a bitmap, starting from group first and
+ * holding the lock of the group, until it returns true.
+ *
+ * Groups that are busy are skipped at first, so that threads working in
+ * different groups never wait for each other while there is room elsewhere.
+ * They are waited for only if none of the other groups had room.
+ *
+ * @param fs       file system context.
+ * @param groups   the allocation groups.
+ * @param ngroups  number of groups (at most A1FS_MAX_GROUPS).
+ * @param first    index of the group to start from.
+ * @param fn       function to call; returns true when done.
+ * @param arg      argument passed to fn.
+ * @return         true if fn returned true; false otherwise.
+ */
+bool groups_visit(fs_ctx *fs, alloc_group *groups, unsigned int ngroups, unsigned int first,
+                  bool (*fn)(fs_ctx *fs, alloc_group *g, void *arg), void *arg) {
+    uint64_t busy = 0;
+    for (unsigned int i = 0; i < ngroups; i++) {
+        unsigned int g = (first + i) % ngroups;
+        if (pthread_mutex_trylock(&groups[g].lock) != 0) {
+            busy |= 1ul << g;
+            continue;
         }
+        bool done = fn(fs, &groups[g], arg);
+        pthread_mutex_unlock(&groups[g].lock);
+        if (done) return true;
+    }
 
-        else {
-            if (activate) {
-                free_extents[*extent_count].start = start;
-                free_extents[*extent_count].count = block_count;
-                activate = false;
-                block_count = 0;
-                start = 0;
+    for (unsigned int i = 0; (i < ngroups) && (busy != 0); i++) {
+        unsigned int g = (first + i) % ngroups;
+        if (!(busy & (1ul << g))) continue;
+        busy &= ~(1ul << g);
+        pthread_mutex_lock(&groups[g].lock);
+        bool done = fn(fs, &groups[g], arg);
+        pthread_mutex_unlock(&groups[g].lock);
+        if (done) return true;
+    }
+    return false;
+}
 
-                *extent_count = *extent_count + 1;
 
-            } 
-            else {continue;}
+/**
+ * Set (used == true) or clear the bits of clusters [start, start + count) in
+ * the data bitmap and account for their blocks in the superblock and in the
+ * descriptors of their block groups. The caller must hold the locks of the
+ * allocation groups of the clusters.
+ */
+void data_bits_update(fs_ctx *fs, uint64_t start, uint64_t count, bool used) {
+    struct a1fs_superblock *sp = (struct a1fs_superblock *)(fs->image);
+    uint64_t cpg = sp->s_blocks_per_group >> fs->cluster_bits;
+
+    while (count != 0) {
+        a1fs_group_desc *gd = &fs->gd[start / cpg];
+        uint64_t n = (start / cpg + 1) * cpg - start;
+        if (n > count) n = count;
+        if (used) {
+            unsigned int changed = bitmap_set_range(&fs->data_bm, start, n) << fs->cluster_bits;
+            __atomic_add_fetch(&sp->blocks_usd, changed, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&gd->free_blocks, changed, __ATOMIC_RELAXED);
+        } else {
+            unsigned int changed = bitmap_clear_range(&fs->data_bm, start, n) << fs->cluster_bits;
+            __atomic_sub_fetch(&sp->blocks_usd, changed, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&gd->free_blocks, changed, __ATOMIC_RELAXED);
         }
+        start += n;
+        count -= n;
     }
+}
+
 
-	// free_extents[*extent_count] = NULL;	
-	return free_extents;
+/**
+ * Mark free clusters [start, start + count) of a data group used. The caller
+ * must hold the lock of the group.
+ */
+void group_claim(fs_ctx *fs, alloc_group *g, uint64_t start, uint64_t count) {
+    freespace_remove(&g->freespace, start, count);
+    data_bits_update(fs, start, count, true);
 }
 
 
+/** Get the number of free data blocks, including the reserved ones. */
+uint64_t data_free_blocks(fs_ctx *fs) {
+    return (fs->data_bm.nbits - __atomic_load_n(&fs->data_bm.used, __ATOMIC_RELAXED)) << fs->cluster_bits;
+}
 
-void swap(struct a1fs_extent *xp, struct a1fs_extent *yp) 
-{ 
-    struct a1fs_extent temp = *xp; 
-    *xp = *yp; 
-    *yp = temp; 
-} 
-void sort_extents(struct a1fs_extent *free_extents, int n) {
 
-    int i, j; 
-    for (i = 0; i < n-1; i++)       
-  
-       // Last i elements are already in place    
-       for (j = 0; j < n-i-1; j++)  
-           if (free_extents[j].count  > free_extents[j+1].count) 
-              swap(&free_extents[j], &free_extents[j+1]); 
+/** Get the append reservation slot of a file. */
+resv_entry *resv_slot(fs_ctx *fs, a1fs_ino_t ino) {
+    return &fs->resv[ino % A1FS_RESV_SLOTS];
 }
 
-int sum_extents(struct a1fs_extent *free_extents, int n) {
 
-    int sum = 0; 
-    for (int i = 0; i < n; i++) {
-        sum = sum + free_extents[i].count;
-    }
-    return sum;
+/**
+ * Return the blocks of a reservation to the free space index. The caller must
+ * hold resv_lock.
+ */
+void resv_release(fs_ctx *fs, resv_entry *resv) {
+    alloc_group *g = data_group(fs, resv->start);
+    pthread_mutex_lock(&g->lock);
+    freespace_add(&g->freespace, resv->start, resv->count);
+    pthread_mutex_unlock(&g->lock);
+    fs->resv_blocks -= resv->count;
+    resv->count = 0;
 }
 
 
+/** Return the blocks reserved for a file (if any) to the free space index. */
+void resv_drop(fs_ctx *fs, a1fs_ino_t ino) {
+    resv_entry *resv = resv_slot(fs, ino);
+    pthread_mutex_lock(&fs->resv_lock);
+    if ((resv->count != 0) && (resv->ino == ino)) resv_release(fs, resv);
+    pthread_mutex_unlock(&fs->resv_lock);
+}
 
-void set_multiple_data_bitmap(void *image, struct a1fs_superblock *sp, struct a1fs_extent extent) {
 
-    int n = extent.count;
-    int data_start = (extent.start)/A1FS_BLOCK_SIZE;
-    unsigned char *data_bit_start = (unsigned char *)(image + sp->data_bitmap_pt);
+/**
+ * Return all reservations to the free space index, e.g. when space runs low.
+ *
+ * @return  number of clusters that were reserved.
+ */
+uint64_t resv_drop_all(fs_ctx *fs) {
+    pthread_mutex_lock(&fs->resv_lock);
+    uint64_t dropped = fs->resv_blocks;
+    for (int i = 0; i < A1FS_RESV_SLOTS; i++) {
+        if (fs->resv[i].count != 0) resv_release(fs, &fs->resv[i]);
+    }
+    pthread_mutex_unlock(&fs->resv_lock);
+    return dropped;
+}
 
 
-    for (int i = data_start; i < data_start + n; i ++) {
-        int data_start_row = i/8;
-        int data_start_col = i%8;
-        data_bit_start[data_start_row] |= (1 << (7 - data_start_col));
+/**
+ * Take up to n blocks (whole clusters) starting at block start out of the
+ * reservation of a file and mark them used. A reservation that doesn't start
+ * there is stale (the file was written elsewhere) and is dropped.
+ *
+ * @return  number of blocks taken.
+ */
+uint64_t resv_take(fs_ctx *fs, a1fs_ino_t ino, uint64_t start, uint64_t n) {
+    resv_entry *resv = resv_slot(fs, ino);
+    uint64_t blocks = n;
+    n = blocks_to_clusters(fs, n);
+    pthread_mutex_lock(&fs->resv_lock);
+    if ((resv->count == 0) || (resv->ino != ino)) {
+        n = 0;
+    } else if ((resv->start << fs->cluster_bits) != start) {
+        resv_release(fs, resv);
+        n = 0;
+    } else {
+        // A reservation never crosses a group boundary
+        start = resv->start;
+        alloc_group *g = data_group(fs, start);
+        if (n > resv->count) n = resv->count;
+        pthread_mutex_lock(&g->lock);
+        data_bits_update(fs, start, n, true);
+        pthread_mutex_unlock(&g->lock);
+        resv->start += n;
+        resv->count -= n;
+        fs->resv_blocks -= n;
     }
+    pthread_mutex_unlock(&fs->resv_lock);
+    n <<= fs->cluster_bits;
+    return (n < blocks) ? n : blocks;
 }
 
 
-void rm_multiple_data_bitmap(void *image, struct a1fs_superblock *sp, struct a1fs_extent extent) {
+/**
+ * Reserve up to n free blocks (whole clusters) starting at block start for a
+ * file, evicting the reservation of whatever file occupied its slot. Nothing
+ * is done if the file already has a reservation.
+ */
+void resv_make(fs_ctx *fs, a1fs_ino_t ino, uint64_t start, uint64_t n) {
+    if (start & (cluster_blocks(fs) - 1)) return;
+    start >>= fs->cluster_bits;
+    n = blocks_to_clusters(fs, n);
+
+    resv_entry *resv = resv_slot(fs, ino);
+    pthread_mutex_lock(&fs->resv_lock);
+    if ((resv->count != 0) && (resv->ino == ino)) {
+        pthread_mutex_unlock(&fs->resv_lock);
+        return;
+    }
+    if (resv->count != 0) resv_release(fs, resv);
+
+    if (start < fs->data_bm.nbits) {
+        // Free extents don't cross group boundaries, so neither does this one
+        alloc_group *g = data_group(fs, start);
+        pthread_mutex_lock(&g->lock);
+        uint64_t avail = freespace_free_at(&g->freespace, start);
+        if (n > avail) n = avail;
+        if (n != 0) freespace_remove(&g->freespace, start, n);
+        pthread_mutex_unlock(&g->lock);
+
+        if (n != 0) {
+            resv->ino = ino;
+            resv->start = start;
+            resv->count = n;
+            fs->resv_blocks += n;
+        }
+    }
+    pthread_mutex_unlock(&fs->resv_lock);
+}
 
-    int n = extent.count;
-    int data_start = (extent.start)/A1FS_BLOCK_SIZE;
 
+/**
+ * Set the bits of the data blocks of an extent to 0 in data bitmap and account
+ * for them in the superblock.
+ *
+ * Extents start on a cluster boundary and own the clusters up to their end,
+ * so a range that starts inside a cluster (the tail of a trimmed extent)
+ * leaves that cluster to the rest of its extent.
+ */
+void rm_multiple_data_bitmap(fs_ctx *fs, struct a1fs_extent extent) {
+    uint64_t start = blocks_to_clusters(fs, extent.start);
+    uint64_t end = blocks_to_clusters(fs, extent.start + extent.count);
+    uint64_t count = (end > start) ? end - start : 0;
+
+    // An extent grown in place may span several groups
+    while (count != 0) {
+        alloc_group *g = data_group(fs, start);
+        uint64_t n = g->first + g->count - start;
+        if (n > count) n = count;
+        pthread_mutex_lock(&g->lock);
+        data_bits_update(fs, start, n, false);
+        freespace_add(&g->freespace, start, n);
+        pthread_mutex_unlock(&g->lock);
+        start += n;
+        count -= n;
+    }
+}
 
-    unsigned char *data_bit_start = (unsigned char *)(image + sp->data_bitmap_pt);
 
-    for (int i = data_start; i < data_start + n; i ++) {
-        int data_start_row = i/8;
+/** Data cluster allocation request; see alloc_extent(). */
+typedef struct alloc_request {
+    /** Cluster to allocate at if possible; UINT64_MAX if none. */
+    uint64_t goal;
+    /** Number of contiguous free clusters to look for. */
+    uint64_t want;
+    /** Largest number of clusters to take. */
+    uint64_t max;
+    /** true to settle for the largest free extent if none has want clusters. */
+    bool any;
+    /** The clusters taken. */
+    uint64_t start, count;
 
-        char hex;
+} alloc_request;
 
-        switch(i%8){
 
-            case 0:
-                hex = 0x7F;
-                break;
-            case 1:
-                hex = 0xBF;
-                break;
-            case 2:
-                hex = 0xDF;
-                break;
-            case 3:
-                hex = 0xEF;	
-                break;	
-            case 4:
-                hex = 0xF7;
-                break;
-            case 5:
-                hex = 0xFB;
-                break;
-            case 6:
-                hex = 0xFD;
-                break;
-            case 7:
-                hex = 0xFE;
-                break;
-            default:
-                hex = 0x00;
-        }
+/** Serve an allocation request from a data group; see groups_visit(). */
+bool group_alloc_extent(fs_ctx *fs, alloc_group *g, void *arg) {
+    alloc_request *req = arg;
+    uint64_t start, count;
+    bool found = false;
+
+    if ((req->goal >= g->first) && (req->goal - g->first < g->count)) {
+        found = freespace_near_fit(&g->freespace, req->goal, req->want, &start, &count);
+    }
+    if (!found) found = freespace_best_fit(&g->freespace, req->want, &start, &count);
+    if (!found && req->any) found = freespace_largest(&g->freespace, &start, &count);
+    if (!found) return false;
+
+    req->start = start;
+    req->count = (count < req->max) ? count : req->max;
+    group_claim(fs, g, req->start, req->count);
+    return true;
+}
 
-	    data_bit_start[data_start_row] &= (hex);
+
+/**
+ * Allocate data blocks: the free space at or after goal if possible (so that
+ * a file stays contiguous), otherwise the smallest free extent that has want
+ * blocks, otherwise (unless exact) the largest free extent. The group of goal
+ * (or the home group of the thread if there is no goal) is searched first.
+ * Whole clusters are taken; the extent starts on a cluster boundary and owns
+ * the rest of its last cluster.
+ *
+ * @param fs        file system context.
+ * @param goal      block the file continues at; UINT64_MAX if none.
+ * @param want      number of contiguous blocks wanted.
+ * @param max       largest number of blocks to take (at most want).
+ * @param exact     true to fail rather than take fewer than max blocks.
+ * @param extent    pointer to the extent that receives the blocks taken (start is a block index).
+ *
+ * @return          0 on success; -1 if there is no free space.
+ */
+int alloc_extent(fs_ctx *fs, uint64_t goal, uint64_t want, uint64_t max, bool exact, struct a1fs_extent *extent) {
+    if (goal != UINT64_MAX) goal >>= fs->cluster_bits;
+    alloc_request req = {goal, blocks_to_clusters(fs, want), blocks_to_clusters(fs, max), false, 0, 0};
+    unsigned int first = (goal < fs->data_bm.nbits) ? data_group_index(fs, goal)
+                                                    : thread_home(fs, fs->data_ngroups);
+    for (;;) {
+        req.any = false;
+        if (groups_visit(fs, fs->data_groups, fs->data_ngroups, first, group_alloc_extent, &req)) break;
+        req.any = !exact;
+        if (req.any && groups_visit(fs, fs->data_groups, fs->data_ngroups, first, group_alloc_extent, &req)) break;
+        // Reserved blocks are the last resort
+        if (resv_drop_all(fs) == 0) return -1;
     }
+
+    extent->start = req.start << fs->cluster_bits;
+    extent->count = ((req.count << fs->cluster_bits) < max) ? req.count << fs->cluster_bits : max;
+    return 0;
+}
+
+
+/**
+ * Allocate up to n free data blocks (whole clusters) starting right at block
+ * goal, which must start a cluster.
+ *
+ * @return  number of blocks taken (0 if goal is in use).
+ */
+uint64_t alloc_extent_at(fs_ctx *fs, uint64_t goal, uint64_t n) {
+    if (goal & (cluster_blocks(fs) - 1)) return 0;
+    uint64_t blocks = n;
+    goal >>= fs->cluster_bits;
+    n = blocks_to_clusters(fs, n);
+    if (goal >= fs->data_bm.nbits) return 0;
+
+    alloc_group *g = data_group(fs, goal);
+    pthread_mutex_lock(&g->lock);
+    uint64_t avail = freespace_free_at(&g->freespace, goal);
+    if (n > avail) n = avail;
+    if (n != 0) group_claim(fs, g, goal, n);
+    pthread_mutex_unlock(&g->lock);
+    n <<= fs->cluster_bits;
+    return (n < blocks) ? n : blocks;
 }
 
 
 /**
  * Set the bit to 0 in inode/data bitmap.
  *
- * @param image     pointer points to the start of the image file.
- * @param sp        a1fs_superblock of the image file.
+ * @param fs        file system context.
  * @param ino       the index of the inode or data block that needs to be set to 0 on bitmap.
  * @param bitmap    1 for inode bitmap pointer, 0 for data bitmap pointer.
  * 
  * @return        0 on success; -1 on error.
  */
-int rm_single_bitmap(void *image, struct a1fs_superblock *sp, int ino,  int bitmap) {
-    int bit;
-    if (bitmap) {
-        bit = sp->s_inodes_count;
-    } else {
-        bit = sp->datablocks_count;
+int rm_single_bitmap(fs_ctx *fs, uint64_t ino, int bitmap) {
+    struct a1fs_superblock *sp = (struct a1fs_superblock *)(fs->image);
+    struct bitmap *bm = get_bitmap(fs, bitmap);
+    // The data bitmap has a bit per cluster
+    if ((bitmap ? ino : ino >> fs->cluster_bits) >= bm->nbits) return -1;
+
+    if (!bitmap) {
+        struct a1fs_extent extent;
+        extent.start = ino;
+        extent.count = 1;
+        rm_multiple_data_bitmap(fs, extent);
+        return 0;
     }
-	if (ino >= bit) return -1;
 
-	int index_a = ino/8;
-	int index_b = ino%8;
+    // Inode groups have the size of the first one too
+    alloc_group *g = &fs->inode_groups[ino / fs->inode_groups[0].count];
+    pthread_mutex_lock(&g->lock);
+    if (bitmap_clear_range(bm, ino, 1) != 0) {
+        __atomic_sub_fetch(&sp->inodes_usd, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&fs->gd[ino / sp->s_inodes_per_group].free_inodes, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&g->lock);
+    return 0;
+}
 
-	char hex;
 
-	switch(index_b)
-    {
-        case 0:
-			hex = 0x7F;
-			break;
-        case 1:
-			hex = 0xBF;
-			break;
-        case 2:
-			hex = 0xDF;
-			break;
-        case 3:
-			hex = 0xEF;	
-			break;	
-		case 4:
-			hex = 0xF7;
-			break;
-        case 5:
-			hex = 0xFB;
-			break;
-        case 6:
-			hex = 0xFD;
-			break;
-        case 7:
-			hex = 0xFE;
-			break;
-        default:
-            hex = 0x00;
-    }
-
-    unsigned char *bitmap_bits;
-    if (bitmap) {
-        bitmap_bits = (unsigned char *)(image + sp->inode_bitmap_pt + index_a);
-    } else {
-        bitmap_bits = (unsigned char *)(image + sp->data_bitmap_pt + index_a);
-    }
+/** Take the first free inode of an inode group; see groups_visit(). */
+bool group_alloc_inode(fs_ctx *fs, alloc_group *g, void *arg) {
+    struct a1fs_superblock *sp = (struct a1fs_superblock *)(fs->image);
+    uint64_t end = g->first + g->count;
+    uint64_t i = bitmap_find_zero_in(&fs->inode_bm, g->first, end);
+    if (i == end) return false;
 
-	bitmap_bits[0] &= (hex);
-	return 0;
+    bitmap_set_range(&fs->inode_bm, i, 1);
+    __atomic_add_fetch(&sp->inodes_usd, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&fs->gd[i / sp->s_inodes_per_group].free_inodes, 1, __ATOMIC_RELAXED);
+    *(uint64_t *)arg = i;
+    return true;
 }
 
 
 /**
- * Find the first 0-bit in inode bitmap and set it to 1.
+ * Find the first 0-bit in inode bitmap (starting from the home group of the
+ * thread), or a free block in the smallest free extent of the data region,
+ * and set it to 1.
  *
- * @param image     pointer points to the start of the image file.
- * @param sp        a1fs_superblock of the image file.
+ * @param fs        file system context.
  * @param result    pointer to the integer that receives the index of the bit in bitmap.
  * @param bitmap    1 for inode bitmap pointer, 0 for data bitmap pointer.
 
  * @return          0 on success; -1 on error.
  */
-int set_single_bitmap(void *image, struct a1fs_superblock *sp, int *result, int bitmap) {
-	int bit;
-    unsigned char *bitmap_bits;
+int set_single_bitmap(fs_ctx *fs, uint64_t *result, int bitmap) {
     if (bitmap) {
-        bit = sp->s_inodes_count;
-        bitmap_bits = (unsigned char *)(image + sp->inode_bitmap_pt);
-    } else {
-        bit = sp->datablocks_count;
-        bitmap_bits = (unsigned char *)(image + sp->data_bitmap_pt);
-    }
-
-
-	for (int i = 0; i < bit; i++) {
-		int index_a = i/8;
-		int index_b = i%8;
-		int left_shift = 7 - index_b;
-
-		if ((bitmap_bits[index_a] & (1 << left_shift)) == 0) {
-			 bitmap_bits[index_a] |= (1 << left_shift);
-			 *result = i;
-			 return 0;
-		}
-	}
-	return -1;
-}
-
-
-/**
- * return the inode number of the last valid entry for the given path
- * assumption: path is not "/".
-*/
-int get_inode(const char *path, void *image, struct a1fs_superblock *sp, int *result){
-	// Get current file or directory attributes.
-	struct a1fs_inode *current_inode = (struct a1fs_inode *)(image + sp->s_first_inode);
-	struct a1fs_extent *cur_extent;
-	int cur_ino = 0;
-
-	// find the inode
-	char pathA[strlen(path)];
-    strcpy(pathA, path+1);
-    char* token = strtok(pathA, "/");
-    while (token != NULL) {
-		bool found = false;
-		// check if current path prefix is not a directory
-		if ((current_inode->mode & S_IFMT)!=S_IFDIR) {
-			return -ENOTDIR;
-		}
-
-		// one extent may not hold all the entries, modify later.
-		for (int j = 0; j < current_inode->extent_used; j++) {
-			cur_extent = (struct a1fs_extent *)(image + sp->s_first_data_block + current_inode->extend_pt + j * sizeof(a1fs_extent));
-
-			int entry_length = (cur_extent->count) * A1FS_BLOCK_SIZE / sizeof(a1fs_dentry);
-			for (int i = 0; i < entry_length; i++) {
-				struct a1fs_dentry *cur_entry = (struct a1fs_dentry *)(image + sp->s_first_data_block + cur_extent->start + i * sizeof(a1fs_dentry));
-				if (strcmp(cur_entry->name, " ") == 0) {
-					entry_length++;
-					continue;	
-				}
-				if (strcmp(cur_entry->name, token) == 0) {
-					found = true;
-					// Update current file or directory attributes.
-					cur_ino = cur_entry->ino;
-					current_inode = (struct a1fs_inode *)(image + sp->s_first_inode + cur_ino * sizeof(a1fs_inode));
-					break;
-				}
-			}
-			if (found) {break;}
-		}
-
-		if (!found) {break;}
-        token = strtok(NULL, "/");
-    }
-
-	*result = cur_ino;
-	return 0;
+        unsigned int first = thread_home(fs, fs->inode_ngroups);
+        return groups_visit(fs, fs->inode_groups, fs->inode_ngroups, first, group_alloc_inode, result) ? 0 : -1;
+    }
+
+    // Single blocks fill the smallest holes to keep large extents intact
+    struct a1fs_extent extent;
+    if (alloc_extent(fs, UINT64_MAX, 1, 1, true, &extent) != 0) return -1;
+    *result = extent.start;
+    return 0;
+}
+
+
+/**
+ * Find n contiguous free data blocks (in the smallest free extent that has them)
+ * and set their bits to 1 in data bitmap.
+ *
+ * @param fs        file system context.
+ * @param n         number of blocks.
+ * @param result    pointer to the integer that receives the index of the first block.
+ *
+ * @return          0 on success; -1 if there is no such run.
+ */
+int set_run_bitmap(fs_ctx *fs, int n, a1fs_blk_t *result) {
+    struct a1fs_extent extent;
+    if (alloc_extent(fs, UINT64_MAX, n, n, true, &extent) != 0) return -1;
+    *result = extent.start;
+    return 0;
 }
 
 
+/**
+ * Set the bit to 0 in inode bitmap and account for it in the superblock.
+ *
+ * @param fs      file system context.
+ * @param ino     the index of the inode that needs to be set to 0 on inode bitmap.
+ * 
+ * @return        0 on success; -1 on error.
+ */
+int rm_inode_bitmap(fs_ctx *fs, int ino) {
+	return rm_single_bitmap(fs, ino, 1);
+}
+
 
 /**
- * Assign the extent to inode with give size. if the size is too big for extent, return the remaining size. 
+ * Find a 0-bit in inode bitmap, set it to 1 and account for it in the superblock.
  *
- * @param block_size      size to be allocated
- * @param extent    the extent
- * @param inode     the inode
- * @param leftover  the integer that receives the remaining size.
+ * @param fs      file system context.
+ * @param result  pointer to the integer that receives the index of the bit in inode bitmap.
  * 
+ * @return        0 on success; -1 on error.
  */
-int allocate_extent(void *image, struct a1fs_superblock *sp, int block_size, struct a1fs_extent extent, struct a1fs_inode *inode, int *leftover) {
+int set_inode_bitmap(fs_ctx *fs, int *result) {
+	uint64_t ino;
+	if (set_single_bitmap(fs, &ino, 1) != 0) return -1;
+	*result = ino;
+	return 0;
+}
 
-    int new_count; 
-    if ((unsigned int)block_size > extent.count) {
-        new_count = extent.count;
-        *leftover = block_size - extent.count;
+
+/** Get a pointer to the inode with the given number (in the inode table of its block group). */
+struct a1fs_inode *inode_at(fs_ctx *fs, a1fs_ino_t ino) {
+    struct a1fs_superblock *sp = (struct a1fs_superblock *)(fs->image);
+    a1fs_group_desc *gd = &fs->gd[ino / sp->s_inodes_per_group];
+    return (struct a1fs_inode *)(fs->image + (size_t)gd->inode_table * A1FS_BLOCK_SIZE
+                                 + (ino % sp->s_inodes_per_group) * sizeof(a1fs_inode));
+}
+
+
+/**
+ * Fill in the attributes of an inode that a1fs keeps (see a1fs_getattr());
+ * the remaining fields are left as they are. The caller holds the inode lock.
+ */
+void inode_stat(struct a1fs_inode *inode, struct stat *st) {
+    st->st_mode  = inode->mode;
+    st->st_nlink = inode->links;
+    st->st_size  = inode->size;
+    if (S_ISREG(inode->mode)) {
+        // Holes take no space
+        st->st_blocks = (blkcnt_t)inode->blocks * (A1FS_BLOCK_SIZE / 512);
     } else {
-        new_count = block_size;
-        *leftover = 0;
+        st->st_blocks = inode->size / 512;
     }
-   
-    if (inode->extent_used == 0) {
-		struct a1fs_extent *first_extent = (image + sp->s_first_data_block + inode->extend_pt);
-		first_extent->start = extent.start * A1FS_BLOCK_SIZE;
-		first_extent->count = new_count;
-        memset((image + sp->s_first_data_block + first_extent->start), 0, A1FS_BLOCK_SIZE*first_extent->count);
+    st->st_mtim  = inode->mtime;
+}
 
-    } else {
-        int extent_index = inode->extent_used;
-        struct a1fs_extent *new_extent = (image + sp->s_first_data_block + inode->extend_pt + extent_index * sizeof(a1fs_extent));
-        new_extent->count = new_count;
-        new_extent->start = extent.start * A1FS_BLOCK_SIZE;
-        memset((image + sp->s_first_data_block + new_extent->start), 0, A1FS_BLOCK_SIZE*new_extent->count);
 
-    }
-    inode->extent_used ++;
-    return 0;
+/**
+ * Get the block that the first extent of a file should start at: the inodes
+ * of a block group spread their data evenly over the blocks of the group.
+ */
+uint64_t inode_goal(fs_ctx *fs, a1fs_ino_t ino) {
+    struct a1fs_superblock *sp = (struct a1fs_superblock *)(fs->image);
+    uint64_t ipg = sp->s_inodes_per_group;
+    uint64_t goal = (uint64_t)(ino / ipg) * sp->s_blocks_per_group
+                    + (ino % ipg) * sp->s_blocks_per_group / ipg;
+    return (goal < sp->s_blocks_count) ? goal : sp->s_blocks_count - 1;
+}
+
+
+/** Get a pointer to the i-th extent of an inode. */
+struct a1fs_extent *extent_at(fs_ctx *fs, struct a1fs_inode *inode, int i) {
+    return (struct a1fs_extent *)block_at(fs, inode->extend_pt) + i;
+}
+
+
+/** Get a pointer to the i-th directory entry slot of a directory extent. */
+struct a1fs_dentry *dentry_at(fs_ctx *fs, struct a1fs_extent *extent, int i) {
+    return (struct a1fs_dentry *)block_at(fs, extent->start) + i;
+}
+
+
+/** Check if the contents of a regular file are stored in its inode. */
+bool file_is_inline(struct a1fs_inode *inode) {
+    return (inode->flags & A1FS_INODE_INLINE_DATA) != 0;
+}
+
+
+/** Get the extent lookup cursor slot of a file. */
+extent_cursor *cursor_slot(fs_ctx *fs, a1fs_ino_t ino) {
+    return &fs->cursor[ino % A1FS_CURSOR_SLOTS];
 }
 
 
+/**
+ * Forget the extents cached for a file after its extent tree has changed, in
+ * the shared cursor and in the cursors of its open files alike. The caller
+ * holds the inode lock for writing.
+ */
+void cursor_reset(fs_ctx *fs, a1fs_ino_t ino) {
+    fs->extent_gen[ino]++;
+}
+
 
 /**
- * Set the bit to 0 in inode bitmap.
+ * Allocate the extent lookup cursor of an open file, so that I/O through one
+ * file handle neither walks the tree nor evicts the extent cached for another.
  *
- * @param image   pointer points to the start of the image file.
- * @param sp      a1fs_superblock of the image file.
- * @param ino     the index of the inode that needs to be set to 0 on inode bitmap.
- * 
- * @return        0 on success; -1 on error.
+ * @return  the cursor (freed with free()); NULL if out of memory.
  */
-int rm_inode_bitmap(void *image, struct a1fs_superblock *sp, int ino) {
-	int bit = sp->s_inodes_count;
-	if (ino >= bit) return -1;
+extent_cursor *cursor_new(a1fs_ino_t ino) {
+    extent_cursor *cursor = calloc(1, sizeof(extent_cursor));
+    if (cursor != NULL) cursor->ino = ino;
+    return cursor;
+}
 
-	int index_a = ino/8;
-	int index_b = ino%8;
 
-	char hex;
+/** Get an extent tree node by its block number. */
+struct a1fs_extent_node *enode_at(fs_ctx *fs, a1fs_blk_t pt) {
+    return (struct a1fs_extent_node *)block_at(fs, pt);
+}
 
-	switch(index_b)
-    {
-        case 0:
-			hex = 0x7F;
-			break;
-        case 1:
-			hex = 0xBF;
-			break;
-        case 2:
-			hex = 0xDF;
-			break;
-        case 3:
-			hex = 0xEF;	
-			break;	
-		case 4:
-			hex = 0xF7;
-			break;
-        case 5:
-			hex = 0xFB;
-			break;
-        case 6:
-			hex = 0xFD;
-			break;
-        case 7:
-			hex = 0xFE;
-			break;
-        default:
-            hex = 0x00;
-    }
-
-
-	unsigned char *inode_bits = (unsigned char *)(image + sp->inode_bitmap_pt + index_a);
-	inode_bits[0] &= (hex);
-	return 0;
+
+/** Get the root of the extent tree of a file (stored in the inode). */
+struct a1fs_extent_node *eroot_at(struct a1fs_inode *inode) {
+    // Same layout as a node; only the first few entries exist
+    return (struct a1fs_extent_node *)&inode->root;
+}
+
+
+/** Get the size of the entries of an extent tree node. */
+size_t enode_entry_size(struct a1fs_extent_node *node) {
+    return node->depth ? sizeof(a1fs_extent_idx) : sizeof(a1fs_extent_leaf);
+}
+
+
+/** Get the number of entries that fit into an extent tree node (or the root). */
+int enode_max(struct a1fs_extent_node *node, bool root) {
+    if (root) return node->depth ? A1FS_EXTENT_ROOT_IDX_MAX : A1FS_EXTENT_ROOT_LEAF_MAX;
+    return node->depth ? A1FS_EXTENT_IDX_MAX : A1FS_EXTENT_LEAF_MAX;
 }
 
 
 /**
- * Find the first 0-bit in inode bitmap and set it to 1.
+ * Find the last entry of an extent tree node whose logical block is at most
+ * lblk (binary search).
  *
- * @param image   pointer points to the start of the image file.
- * @param sp      a1fs_superblock of the image file.
- * @param result  pointer to the integer that receives the index of the bit in inode bitmap.
- * 
- * @return        0 on success; -1 on error.
+ * @return  index of the entry; -1 if lblk is before the first entry.
+ */
+int enode_search(struct a1fs_extent_node *node, uint64_t lblk) {
+    int lo = 0;
+    int hi = node->nentries;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        uint32_t key = node->depth ? node->idx[mid].lblk : node->leaf[mid].lblk;
+        if (key <= lblk) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+
+/**
+ * Allocate an empty extent tree node.
+ *
+ * @param fs     file system context.
+ * @param depth  height of the node above the leaves.
+ * @param pt     pointer to the variable that receives the block number of the node.
+ * @return       0 on success; -ENOSPC if out of space.
+ */
+int enode_alloc(fs_ctx *fs, int depth, a1fs_blk_t *pt) {
+    if (set_single_bitmap(fs, pt, 0) == -1) return -ENOSPC;
+
+    struct a1fs_extent_node *node = enode_at(fs, *pt);
+    node->magic = A1FS_EXTENT_NODE_MAGIC;
+    node->nentries = 0;
+    node->depth = depth;
+    node->pad = 0;
+    return 0;
+}
+
+
+/**
+ * Split the full child at index pos of an extent tree node in two halves. The
+ * node must have room for another entry.
+ *
+ * @return  0 on success; -ENOSPC if out of space.
  */
-int set_inode_bitmap(void *image, struct a1fs_superblock *sp, int *result) {
-	int bit = sp->s_inodes_count;
+int enode_split(fs_ctx *fs, struct a1fs_extent_node *parent, int pos) {
+    struct a1fs_extent_node *child = enode_at(fs, parent->idx[pos].child);
+    a1fs_blk_t sibling_pt;
+    if (enode_alloc(fs, child->depth, &sibling_pt) != 0) return -ENOSPC;
+    struct a1fs_extent_node *sibling = enode_at(fs, sibling_pt);
+
+    size_t size = enode_entry_size(child);
+    int half = child->nentries / 2;
+    sibling->nentries = child->nentries - half;
+    memcpy((char *)sibling->leaf, (char *)child->leaf + half * size, sibling->nentries * size);
+    child->nentries = half;
+
+    memmove(&parent->idx[pos + 2], &parent->idx[pos + 1], (parent->nentries - pos - 1) * sizeof(a1fs_extent_idx));
+    parent->idx[pos + 1].lblk = sibling->depth ? sibling->idx[0].lblk : sibling->leaf[0].lblk;
+    parent->idx[pos + 1].child = sibling_pt;
+    parent->nentries++;
+    return 0;
+}
+
+
+/** Path from the root of an extent tree down to a leaf entry. */
+typedef struct etree_path {
+    /** Depth of the tree (level of the leaf). */
+    int depth;
+    /** Nodes on the path; node[0] is the root in the inode. */
+    struct a1fs_extent_node *node[A1FS_EXTENT_MAX_DEPTH + 1];
+    /** Block numbers of the nodes below the root. */
+    a1fs_blk_t pt[A1FS_EXTENT_MAX_DEPTH + 1];
+    /** Index of the entry in each node; -1 in the leaf if before its first entry. */
+    int pos[A1FS_EXTENT_MAX_DEPTH + 1];
 
-	unsigned char *inode_bits = (unsigned char *)(image + sp->inode_bitmap_pt);
+} etree_path;
 
-	for (int i = 0; i < bit; i++) {
-		int index_a = i/8;
-		int index_b = i%8;
-		int left_shift = 7 - index_b;
 
-		if ((inode_bits[index_a] & (1 << left_shift)) == 0) {
-			 inode_bits[index_a] |= (1 << left_shift);
-			 *result = i;
-			 return 0;
-		}
-	}
-	return -1;
+/**
+ * Descend the extent tree of a file (which must have extents) to the last
+ * extent that starts at or before a logical block.
+ */
+void etree_descend(fs_ctx *fs, struct a1fs_inode *inode, uint64_t lblk, etree_path *path) {
+    struct a1fs_extent_node *node = eroot_at(inode);
+    path->depth = node->depth;
+    path->pt[0] = 0;
+    for (int l = 0; ; l++) {
+        int pos = enode_search(node, lblk);
+        path->node[l] = node;
+        path->pos[l] = pos;
+        if (node->depth == 0) return;
+
+        if (pos < 0) path->pos[l] = 0;
+        path->pt[l + 1] = node->idx[path->pos[l]].child;
+        node = enode_at(fs, path->pt[l + 1]);
+    }
+}
+
+
+/** Get the leaf entry at the end of a path. */
+a1fs_extent_leaf *etree_leaf(etree_path *path) {
+    return &path->node[path->depth]->leaf[path->pos[path->depth]];
 }
 
 
 /**
- * Find the index of the extent for the offset and the index of the offset in that extent.
+ * Move a path to the next leaf entry in logical block order.
  *
- * @param offset        the offset in file
- * @param image         pointer points to the start of the image file.
- * @param sp            a1fs_superblock of the image file.
- * @param inode         the inode of the file
- * @param extent_index  pointer to the integer that receives the index of extent.
- * @param byte_index    pointer to the integer that receives the index of offset in extent_index.
+ * @return  true on success; false if there is no next entry.
  */
-void find_extent(void *image, struct a1fs_superblock *sp, struct a1fs_inode *inode, int offset, int *extent_index, int *byte_index) {
-    int size = offset + 1;
-	for (int i = 0; i < inode->extent_used; i++) {
-        struct a1fs_extent *extent = (struct a1fs_extent *)(image + sp->s_first_data_block + inode->extend_pt + i * sizeof(a1fs_extent));
-        size = size - (extent->count)*A1FS_BLOCK_SIZE;
-        if (size > 0) {
-            continue;
-        }
-        if (size <= 0) {
-            *extent_index = i;
-            *byte_index = size + (extent->count)*A1FS_BLOCK_SIZE - 1;
+bool etree_next(fs_ctx *fs, etree_path *path) {
+    int l = path->depth;
+    while ((l >= 0) && (path->pos[l] + 1 >= path->node[l]->nentries)) l--;
+    if (l < 0) return false;
+
+    path->pos[l]++;
+    for (; l < path->depth; l++) {
+        path->pt[l + 1] = path->node[l]->idx[path->pos[l]].child;
+        path->node[l + 1] = enode_at(fs, path->pt[l + 1]);
+        path->pos[l + 1] = 0;
+    }
+    return true;
+}
+
+
+/**
+ * Extend the leaf entry at the end of a path by n blocks. The blocks must not
+ * be mapped by the file. The index key that bounds the leaf from above is
+ * raised past the extent if necessary; the child it belongs to has no
+ * extents below the new end, so the key is still a lower bound for it.
+ */
+void etree_extend(fs_ctx *fs, a1fs_ino_t ino, etree_path *path, uint64_t n) {
+    a1fs_extent_leaf *leaf = etree_leaf(path);
+    leaf->extent.count += n;
+    uint64_t end = (uint64_t)leaf->lblk + leaf->extent.count;
+
+    for (int l = path->depth - 1; l >= 0; l--) {
+        struct a1fs_extent_node *node = path->node[l];
+        if (path->pos[l] + 1 < node->nentries) {
+            if (node->idx[path->pos[l] + 1].lblk < end) node->idx[path->pos[l] + 1].lblk = end;
             break;
         }
     }
+    cursor_reset(fs, ino);
+}
+
+
+/**
+ * Insert an extent into the extent tree of a file. Full nodes are split on the
+ * way down, so the parent of a node being split always has room for the new
+ * index entry.
+ *
+ * @param fs    file system context.
+ * @param ino   the inode number of the file.
+ * @param ent   the extent; it must not overlap the extents of the file.
+ * @return      0 on success; -ENOSPC if out of space for a tree node (the
+ *              tree is unchanged apart from possibly a split node).
+ */
+int etree_insert(fs_ctx *fs, a1fs_ino_t ino, const a1fs_extent_leaf *ent) {
+    struct a1fs_inode *inode = inode_at(fs, ino);
+    struct a1fs_extent_node *node = eroot_at(inode);
+    if (node->nentries == enode_max(node, true)) {
+        // The root never moves: push its entries down into a new child
+        a1fs_blk_t child_pt;
+        if ((node->depth == A1FS_EXTENT_MAX_DEPTH) || (enode_alloc(fs, node->depth, &child_pt) != 0)) return -ENOSPC;
+        struct a1fs_extent_node *child = enode_at(fs, child_pt);
+        child->nentries = node->nentries;
+        memcpy(child->leaf, node->leaf, node->nentries * enode_entry_size(node));
+        node->depth++;
+        node->nentries = 1;
+        node->idx[0].lblk = ent->lblk;
+        node->idx[0].child = child_pt;
+    }
+
+    // The index entry following the deepest child on the path bounds the leaf
+    a1fs_extent_idx *bound = NULL;
+    while (node->depth > 0) {
+        int pos = enode_search(node, ent->lblk);
+        if (pos < 0) pos = 0;
+        struct a1fs_extent_node *child = enode_at(fs, node->idx[pos].child);
+        if (child->nentries == enode_max(child, false)) {
+            if (enode_split(fs, node, pos) != 0) return -ENOSPC;
+            if (ent->lblk >= node->idx[pos + 1].lblk) pos++;
+        }
+        if (pos + 1 < node->nentries) bound = &node->idx[pos + 1];
+        node = enode_at(fs, node->idx[pos].child);
+    }
+
+    int pos = enode_search(node, ent->lblk) + 1;
+    memmove(&node->leaf[pos + 1], &node->leaf[pos], (node->nentries - pos) * sizeof(a1fs_extent_leaf));
+    node->leaf[pos] = *ent;
+    node->nentries++;
+    // The key may be stale (below the first extent of its child); see etree_extend()
+    if ((bound != NULL) && (bound->lblk < ent->lblk + ent->extent.count)) {
+        bound->lblk = ent->lblk + ent->extent.count;
+    }
+    inode->extent_used++;
+    cursor_reset(fs, ino);
+    return 0;
+}
+
+
+/**
+ * Remove the leaf entry at the end of a path from the extent tree of a file.
+ * Nodes that become empty are freed, and a root with a single child absorbs
+ * it if the entries of the child fit into the root.
+ */
+void etree_delete(fs_ctx *fs, a1fs_ino_t ino, etree_path *path) {
+    struct a1fs_inode *inode = inode_at(fs, ino);
+
+    for (int l = path->depth; l >= 0; l--) {
+        struct a1fs_extent_node *node = path->node[l];
+        size_t size = enode_entry_size(node);
+        char *entries = (char *)node->leaf;
+        int pos = path->pos[l];
+        memmove(entries + pos * size, entries + (pos + 1) * size, (node->nentries - pos - 1) * size);
+        node->nentries--;
+        if ((node->nentries > 0) || (l == 0)) break;
+        rm_single_bitmap(fs, path->pt[l], 0);
+    }
+    inode->extent_used--;
+    cursor_reset(fs, ino);
+
+    struct a1fs_extent_node *root = eroot_at(inode);
+    if (root->nentries == 0) root->depth = 0;
+    while ((root->depth > 0) && (root->nentries == 1)) {
+        a1fs_blk_t child_pt = root->idx[0].child;
+        struct a1fs_extent_node *child = enode_at(fs, child_pt);
+        if (child->nentries > enode_max(child, true)) break;
+
+        root->depth = child->depth;
+        root->nentries = child->nentries;
+        memcpy(root->leaf, child->leaf, child->nentries * enode_entry_size(child));
+        rm_single_bitmap(fs, child_pt, 0);
+    }
+}
+
+
+/**
+ * Find the extent of a file that maps a logical block.
+ *
+ * Repeated lookups within the extent found last are served from the extent
+ * lookup cursor of the file without walking the tree.
+ *
+ * @param fs      file system context.
+ * @param ino     the inode number of the file.
+ * @param cursor  extent lookup cursor of an open file; NULL for the shared one.
+ * @param block   logical block number.
+ * @param leaf   pointer to the variable that receives the extent if found.
+ * @param next   pointer to the variable that receives the first logical block
+ *               mapped after block if not found (UINT64_MAX if none).
+ * @return       true if the block is mapped; false if it is in a hole.
+ */
+bool file_extent_find(fs_ctx *fs, a1fs_ino_t ino, extent_cursor *cursor, uint64_t block, a1fs_extent_leaf *leaf, uint64_t *next) {
+    struct a1fs_inode *inode = inode_at(fs, ino);
+    uint32_t gen = fs->extent_gen[ino];
+    if (cursor == NULL) cursor = cursor_slot(fs, ino);
+    pthread_mutex_lock(&fs->cursor_lock);
+    if ((cursor->ino == ino) && (cursor->gen == gen) && (block >= cursor->leaf.lblk) && (block < (uint64_t)cursor->leaf.lblk + cursor->leaf.extent.count)) {
+        *leaf = cursor->leaf;
+        pthread_mutex_unlock(&fs->cursor_lock);
+        return true;
+    }
+    pthread_mutex_unlock(&fs->cursor_lock);
+
+    *next = UINT64_MAX;
+    if (inode->extent_used == 0) return false;
+
+    etree_path path;
+    etree_descend(fs, inode, block, &path);
+    if (path.pos[path.depth] >= 0) {
+        a1fs_extent_leaf *found = etree_leaf(&path);
+        if (block < (uint64_t)found->lblk + found->extent.count) {
+            pthread_mutex_lock(&fs->cursor_lock);
+            cursor->ino = ino;
+            cursor->gen = gen;
+            cursor->leaf = *found;
+            pthread_mutex_unlock(&fs->cursor_lock);
+            *leaf = *found;
+            return true;
+        }
+    }
+    if (etree_next(fs, &path)) *next = etree_leaf(&path)->lblk;
+    return false;
 }
 
 
 /**
- * Fill the file with zero starting at extent_start extent of file.
- * if EOF is at the end of the last extent, do nothing. 
+ * Get a pointer to the data of a file at a byte offset.
  *
- * @param offset    index of starting point to fill with.
- * @param image     pointer points to the start of the image file.
- * @param sp        a1fs_superblock of the image file.
- * @param inode     the inode of the file
+ * @param fs      file system context.
+ * @param ino     the inode number of the file.
+ * @param cursor  extent lookup cursor of an open file; NULL for the shared one.
+ * @param offset  offset from the beginning of the file.
+ * @param len     pointer to the variable that receives the number of bytes
+ *                from there to the end of the extent or the hole (SIZE_MAX if
+ *                the hole extends past the last extent).
+ * @return        pointer into the image; NULL if the offset is in a hole.
  */
-void fill_zero(void *image, struct a1fs_superblock *sp, struct a1fs_inode *inode, int extent_start) {
+void *file_data(fs_ctx *fs, a1fs_ino_t ino, extent_cursor *cursor, uint64_t offset, size_t *len) {
+    struct a1fs_inode *inode = inode_at(fs, ino);
+    if (file_is_inline(inode)) {
+        if (offset >= A1FS_INLINE_DATA_MAX) {
+            *len = SIZE_MAX;
+            return NULL;
+        }
+        *len = A1FS_INLINE_DATA_MAX - offset;
+        return inode->inline_data + offset;
+    }
 
-    for (int i = extent_start; i < inode->extent_used; i++) {
-        struct a1fs_extent *extent = (struct a1fs_extent *)(image + sp->s_first_data_block + inode->extend_pt + i * sizeof(a1fs_extent));
-        memset((image + sp->s_first_data_block + extent->start), 0, extent->count * A1FS_BLOCK_SIZE);
+    a1fs_extent_leaf leaf;
+    uint64_t next;
+    if (!file_extent_find(fs, ino, cursor, offset / A1FS_BLOCK_SIZE, &leaf, &next)) {
+        *len = (next == UINT64_MAX) ? SIZE_MAX : next * A1FS_BLOCK_SIZE - offset;
+        return NULL;
     }
 
+    uint64_t ext_offset = offset - (uint64_t)leaf.lblk * A1FS_BLOCK_SIZE;
+    *len = (uint64_t)leaf.extent.count * A1FS_BLOCK_SIZE - ext_offset;
+    return block_at(fs, leaf.extent.start) + ext_offset;
 }
 
 
-void dentry_sum(void *image, struct a1fs_superblock *sp, struct a1fs_extent *cur_extent, int *sum) {
-    int entry_length = (cur_extent->count) * A1FS_BLOCK_SIZE / sizeof(a1fs_dentry);
-    for (int i = 0; i < entry_length ; i ++) {
-        struct a1fs_dentry *cur_entry = (struct a1fs_dentry *)(image + sp->s_first_data_block + cur_extent->start + i * sizeof(a1fs_dentry));
-        *sum += cur_entry->ino;
+/** Count the logical blocks in [from, to) that no extent of a file maps. */
+uint64_t file_unmapped(fs_ctx *fs, a1fs_ino_t ino, uint64_t from, uint64_t to) {
+    uint64_t holes = 0;
+    while (from < to) {
+        a1fs_extent_leaf leaf;
+        uint64_t next;
+        if (file_extent_find(fs, ino, NULL, from, &leaf, &next)) {
+            from = (uint64_t)leaf.lblk + leaf.extent.count;
+            continue;
+        }
+        if (next > to) next = to;
+        holes += next - from;
+        from = next;
     }
+    return holes;
 }
 
 
-void swap_extent(void *image, struct a1fs_superblock *sp, struct a1fs_extent *cur_extent, struct a1fs_inode *inode) {
+/**
+ * Find the next data or hole in a file at or after an offset, with the
+ * semantics of lseek() with SEEK_DATA or SEEK_HOLE. There is an implicit hole
+ * at the end of the file.
+ *
+ * @param fs      file system context.
+ * @param ino     the inode number of the file.
+ * @param offset  offset to search from.
+ * @param hole    true to find a hole (SEEK_HOLE); false to find data (SEEK_DATA).
+ * @return        offset of the data or hole; -ENXIO if offset is at or past
+ *                the end of the file, or there is no data after it.
+ */
+off_t file_seek(fs_ctx *fs, a1fs_ino_t ino, off_t offset, bool hole) {
+    struct a1fs_inode *inode = inode_at(fs, ino);
+    if ((offset < 0) || ((uint64_t)offset >= inode->size)) return -ENXIO;
+    if (file_is_inline(inode)) return hole ? (off_t)inode->size : offset;
+
+    uint64_t block = offset / A1FS_BLOCK_SIZE;
+    a1fs_extent_leaf leaf;
+    uint64_t next;
+    if (!hole) {
+        if (file_extent_find(fs, ino, NULL, block, &leaf, &next)) return offset;
+        if ((next == UINT64_MAX) || (next * A1FS_BLOCK_SIZE >= inode->size)) return -ENXIO;
+        return next * A1FS_BLOCK_SIZE;
+    }
 
-    struct a1fs_extent *last_extent = (struct a1fs_extent *)(image + sp->s_first_data_block + inode->extend_pt + (inode->extent_used-1) * sizeof(a1fs_extent));
-    cur_extent->count = last_extent->count;
-    cur_extent->start = last_extent->start;
+    while (file_extent_find(fs, ino, NULL, block, &leaf, &next)) {
+        block = (uint64_t)leaf.lblk + leaf.extent.count;
+    }
+    uint64_t found = block * A1FS_BLOCK_SIZE;
+    if (found < (uint64_t)offset) found = offset;
+    return (found < inode->size) ? (off_t)found : (off_t)inode->size;
 }
 
 
-void rm_target(void *image, struct a1fs_superblock *sp, struct a1fs_inode *inode) {
-    struct a1fs_extent *extent;
-    for (int i = 0; i < inode->extent_used; i++){
-        extent = (struct a1fs_extent *)(image + sp->s_first_data_block + inode->extend_pt + i * sizeof(a1fs_extent));
-        rm_multiple_data_bitmap(image, sp, *extent);
-        int index = inode->extend_pt / A1FS_BLOCK_SIZE;
-        rm_single_bitmap(image, sp, index,  0);
+/**
+ * Free the data blocks of a file in the logical block range [from, to),
+ * leaving a hole. Extents that straddle the range are trimmed or split.
+ *
+ * @param fs    file system context.
+ * @param ino   the inode number of the file.
+ * @param from  first logical block of the range.
+ * @param to    end of the range (exclusive).
+ * @return      0 on success; -ENOSPC if an extent had to be split and there
+ *              is no space for a tree node (the range is then only partially
+ *              unmapped).
+ */
+int file_unmap(fs_ctx *fs, a1fs_ino_t ino, uint64_t from, uint64_t to) {
+    struct a1fs_inode *inode = inode_at(fs, ino);
+
+    while ((from < to) && (inode->extent_used != 0)) {
+        etree_path path;
+        etree_descend(fs, inode, from, &path);
+        a1fs_extent_leaf *leaf = (path.pos[path.depth] >= 0) ? etree_leaf(&path) : NULL;
+        if ((leaf == NULL) || (from >= (uint64_t)leaf->lblk + leaf->extent.count)) {
+            if (!etree_next(fs, &path)) break;
+            leaf = etree_leaf(&path);
+        }
+        uint64_t lo = leaf->lblk;
+        uint64_t hi = lo + leaf->extent.count;
+        if (lo >= to) break;
+
+        bool head = (lo < from);
+        bool tail = (hi > to);
+        if (head) lo = from;
+        if (tail) hi = to;
+        struct a1fs_extent freed = {0};
+        freed.start = leaf->extent.start + (lo - leaf->lblk);
+        freed.count = hi - lo;
+
+        if (head && tail) {
+            a1fs_extent_leaf rest = {0};
+            rest.lblk = hi;
+            rest.extent.start = freed.start + freed.count;
+            rest.extent.count = leaf->lblk + leaf->extent.count - hi;
+            if (etree_insert(fs, ino, &rest) != 0) return -ENOSPC;
+            // The insert may have split the leaf
+            etree_descend(fs, inode, lo, &path);
+            leaf = etree_leaf(&path);
+            leaf->extent.count = lo - leaf->lblk;
+        } else if (head) {
+            leaf->extent.count = lo - leaf->lblk;
+        } else if (tail) {
+            leaf->lblk = hi;
+            leaf->extent.start += freed.count;
+            leaf->extent.count -= freed.count;
+        } else {
+            etree_delete(fs, ino, &path);
+        }
+        cursor_reset(fs, ino);
+
+        rm_multiple_data_bitmap(fs, freed);
+        inode->blocks -= freed.count;
+        from = hi;
     }
-}
\ No newline at end of file
+    return 0;
+}
+
+
+/**
+ * Free the data blocks of a file past its first blocks blocks (including the
+ * ones preallocated past its end). The extent tree is freed as well if no
+ * blocks are left.
+ *
+ * @param fs      file system context.
+ * @param ino     the inode number of the file.
+ * @param blocks  number of blocks to keep.
+ */
+void file_shrink(fs_ctx *fs, a1fs_ino_t ino, uint64_t blocks) {
+    resv_drop(fs, ino);
+    // Nothing is split, so this can't fail; extents map whole clusters
+    file_unmap(fs, ino, align_up(blocks, cluster_blocks(fs)), UINT64_MAX);
+}
+
+
+/**
+ * Allocate data blocks for the holes in a byte range of a file. If the range
+ * is about to be written, the new blocks are only zeroed outside of it, since
+ * the range itself is overwritten right away.
+ *
+ * A hole that follows an extent is filled with the blocks physically following
+ * that extent whenever they are free (or reserved for this file), growing the
+ * extent in place. Afterwards up to A1FS_RESV_MAX blocks following the last
+ * extent are reserved for the next appends.
+ *
+ * @param fs      file system context.
+ * @param ino     the inode number of the file.
+ * @param offset  offset of the range.
+ * @param size    size of the range in bytes.
+ * @param write   true if the range is about to be written.
+ * @param avail   pointer to the variable that receives the number of bytes
+ *                from offset on that have data blocks (size on success).
+ * @return        0 on success; -ENOSPC if out of space.
+ */
+int file_alloc(fs_ctx *fs, a1fs_ino_t ino, uint64_t offset, uint64_t size, bool write, uint64_t *avail) {
+    struct a1fs_inode *inode = inode_at(fs, ino);
+    // Extents map whole clusters
+    uint64_t cluster = cluster_blocks(fs);
+    uint64_t block = offset / A1FS_BLOCK_SIZE / cluster * cluster;
+    uint64_t end = align_up(align_up(offset + size, A1FS_BLOCK_SIZE) / A1FS_BLOCK_SIZE, cluster);
+    uint64_t file_blocks = align_up(inode->size, A1FS_BLOCK_SIZE) / A1FS_BLOCK_SIZE;
+    uint64_t window = (file_blocks < A1FS_RESV_MAX) ? file_blocks : A1FS_RESV_MAX;
+    int ret = 0;
+
+    while (block < end) {
+        a1fs_extent_leaf leaf;
+        uint64_t next;
+        if (file_extent_find(fs, ino, NULL, block, &leaf, &next)) {
+            block = (uint64_t)leaf.lblk + leaf.extent.count;
+            continue;
+        }
+        uint64_t need = ((end < next) ? end : next) - block;
+
+        // The extent that the new blocks continue (logically), if any
+        a1fs_extent_leaf prev;
+        uint64_t unused;
+        bool has_prev = (block > 0) && file_extent_find(fs, ino, NULL, block - 1, &prev, &unused);
+
+        // Fast path: the blocks right after that extent. The blocks are
+        // taken before the tree is updated so that a new tree node isn't
+        // taken from them.
+        struct a1fs_extent free_extent;
+        uint64_t goal = UINT64_MAX;
+        free_extent.count = 0;
+        if (has_prev) {
+            goal = prev.extent.start + prev.extent.count;
+            free_extent.start = goal;
+            if (next == UINT64_MAX) free_extent.count = resv_take(fs, ino, goal, need);
+            if (free_extent.count == 0) free_extent.count = alloc_extent_at(fs, goal, need);
+        } else {
+            // Blocks that continue nothing go to the block group of the inode
+            goal = inode_goal(fs, ino);
+        }
+        if (free_extent.count == 0) {
+            // Start the new extent where there is room for the reservation too
+            if (alloc_extent(fs, goal, (need > window) ? need : window, need, false, &free_extent) != 0) {
+                ret = -ENOSPC;
+                break;
+            }
+        }
+        uint64_t n = free_extent.count;
+
+        struct a1fs_extent taken = {0};
+        taken.start = free_extent.start;
+        taken.count = n;
+
+        if (has_prev && (free_extent.start == goal)) {
+            etree_path path;
+            etree_descend(fs, inode, block - 1, &path);
+            etree_extend(fs, ino, &path, n);
+        } else {
+            a1fs_extent_leaf ent = {0};
+            ent.lblk = block;
+            ent.extent = taken;
+            if (etree_insert(fs, ino, &ent) != 0) {
+                rm_multiple_data_bitmap(fs, taken);
+                ret = -ENOSPC;
+                break;
+            }
+        }
+        inode->blocks += n;
+
+        // Zero the parts of the new blocks that the write doesn't cover
+        void *data = block_at(fs, taken.start);
+        uint64_t lo = block * A1FS_BLOCK_SIZE;
+        uint64_t hi = (block + n) * A1FS_BLOCK_SIZE;
+        if (!write) {
+            memset(data, 0, hi - lo);
+        } else {
+            if (lo < offset) memset(data, 0, offset - lo);
+            if (hi > offset + size) memset(data + (offset + size - lo), 0, hi - (offset + size));
+        }
+        block += n;
+    }
+
+    uint64_t backed = block * A1FS_BLOCK_SIZE;
+    *avail = (backed <= offset) ? 0 : ((backed - offset < size) ? backed - offset : size);
+
+    if ((inode->extent_used != 0) && (ret == 0)) {
+        etree_path path;
+        etree_descend(fs, inode, UINT64_MAX, &path);
+        struct a1fs_extent *last = &etree_leaf(&path)->extent;
+        resv_make(fs, ino, last->start + last->count, window);
+    }
+    return ret;
+}
+
+
+/**
+ * Move the data of a file stored in its inode out to a data block, so that
+ * the file can be mapped by extents.
+ *
+ * @param fs   file system context.
+ * @param ino  the inode number of the file.
+ * @return     0 on success; -ENOSPC if there is no free block (the file is
+ *             unchanged).
+ */
+int file_uninline(fs_ctx *fs, a1fs_ino_t ino) {
+    struct a1fs_inode *inode = inode_at(fs, ino);
+    if (!file_is_inline(inode)) return 0;
+
+    char data[A1FS_INLINE_DATA_MAX];
+    memcpy(data, inode->inline_data, sizeof(data));
+    memset(&inode->root, 0, sizeof(inode->root));
+    inode->flags &= ~A1FS_INODE_INLINE_DATA;
+    if (inode->size == 0) return 0;
+
+    // The data fits in one block, so the allocation is all or nothing
+    uint64_t avail;
+    int ret = file_alloc(fs, ino, 0, inode->size, true, &avail);
+    if (ret != 0) {
+        memcpy(inode->inline_data, data, sizeof(data));
+        inode->flags |= A1FS_INODE_INLINE_DATA;
+        return ret;
+    }
+    size_t len;
+    memcpy(file_data(fs, ino, NULL, 0, &len), data, inode->size);
+    return 0;
+}
+
+
+/**
+ * Turn a byte range of a file into a hole: free the data blocks that lie
+ * entirely within the range and zero the parts of the range in the blocks at
+ * its edges. The file size is unchanged.
+ *
+ * @param fs      file system context.
+ * @param ino     the inode number of the file.
+ * @param offset  offset of the range.
+ * @param size    size of the range in bytes.
+ * @return        0 on success; -ENOSPC if out of space for the extent tree
+ *                (the range is then only partially punched).
+ */
+int file_punch(fs_ctx *fs, a1fs_ino_t ino, uint64_t offset, uint64_t size) {
+    uint64_t end_offset = offset + size;
+
+    // Partial blocks (clusters with bigalloc) at the edges keep their data blocks
+    uint64_t unit = A1FS_BLOCK_SIZE * cluster_blocks(fs);
+    uint64_t block = align_up(offset, unit) / A1FS_BLOCK_SIZE;
+    uint64_t end = end_offset / unit * unit / A1FS_BLOCK_SIZE;
+    uint64_t edges[2][2] = {
+        {offset, (block * A1FS_BLOCK_SIZE < end_offset) ? block * A1FS_BLOCK_SIZE : end_offset},
+        {(end * A1FS_BLOCK_SIZE > offset) ? end * A1FS_BLOCK_SIZE : offset, end_offset},
+    };
+    for (int e = 0; e < 2; e++) {
+        uint64_t pos = edges[e][0];
+        while (pos < edges[e][1]) {
+            size_t len;
+            void *data = file_data(fs, ino, NULL, pos, &len);
+            if (len > edges[e][1] - pos) len = edges[e][1] - pos;
+            if (data != NULL) memset(data, 0, len);
+            pos += len;
+        }
+        // Both edges are in the same block (or cluster)
+        if (block > end) break;
+    }
+
+    return (block < end) ? file_unmap(fs, ino, block, end) : 0;
+}
+
+
+/**
+ * Set the size of a file. Growing a file adds a hole that reads back as zeros
+ * (unless it grows into blocks preallocated by fallocate()); shrinking it
+ * frees the blocks past the new end, preallocated or not.
+ *
+ * @param fs    file system context.
+ * @param ino   the inode number of the file.
+ * @param size  new file size in bytes.
+ * @return      0 on success; -EFBIG if the size is too large, -ENOSPC if the
+ *              data stored in the inode could not be moved out (the file is
+ *              unchanged in both cases).
+ */
+int file_resize(fs_ctx *fs, a1fs_ino_t ino, uint64_t size) {
+    struct a1fs_inode *inode = inode_at(fs, ino);
+
+    if (file_is_inline(inode)) {
+        if (size <= A1FS_INLINE_DATA_MAX) {
+            if (size > inode->size) memset(inode->inline_data + inode->size, 0, size - inode->size);
+            inode->size = size;
+            return 0;
+        }
+        int ret = file_uninline(fs, ino);
+        if (ret != 0) return ret;
+    }
+
+    uint64_t want = align_up(size, A1FS_BLOCK_SIZE) / A1FS_BLOCK_SIZE;
+    if (want > UINT32_MAX) return -EFBIG;
+    if (size < inode->size) file_shrink(fs, ino, want);
+
+    // The rest of the old last block (cluster with bigalloc) may hold data
+    // from before a shrink
+    uint64_t unit = A1FS_BLOCK_SIZE * cluster_blocks(fs);
+    if ((size > inode->size) && (inode->size % unit != 0)) {
+        size_t len;
+        void *data = file_data(fs, ino, NULL, inode->size, &len);
+        uint64_t residue = unit - inode->size % unit;
+        if (residue > size - inode->size) residue = size - inode->size;
+        if (data != NULL) memset(data, 0, residue);
+    }
+    inode->size = size;
+
+    // An empty file with no blocks left goes back to storing its data inline
+    if ((size == 0) && (inode->extent_used == 0)) {
+        memset(inode->inline_data, 0, A1FS_INLINE_DATA_MAX);
+        inode->flags |= A1FS_INODE_INLINE_DATA;
+    }
+    return 0;
+}
+
+
+/**
+ * Trim a file that file_write_begin() extended for a write that then copied
+ * only done bytes of its range, so that the file doesn't grow past the data
+ * (or at all if nothing was written). The blocks allocated past the data stay
+ * with the file past its end, like preallocated ones; they hold zeros as long
+ * as the write was prepared with short_ = true.
+ *
+ * @param fs        file system context.
+ * @param ino       the inode number of the file.
+ * @param old_size  size of the file before file_write_begin().
+ * @param offset    offset of the write.
+ * @param done      number of bytes written.
+ */
+void file_write_end(fs_ctx *fs, a1fs_ino_t ino, uint64_t old_size, uint64_t offset, uint64_t done) {
+    struct a1fs_inode *inode = inode_at(fs, ino);
+    uint64_t end = ((done != 0) && (offset + done > old_size)) ? offset + done : old_size;
+    if (inode->size > end) inode->size = end;
+}
+
+
+/**
+ * Prepare a byte range of a file for a write: extend the file if the range
+ * goes past its end and allocate data blocks for the holes in the range.
+ *
+ * If only a prefix of the range could be allocated, the file size is trimmed
+ * so that the write is short instead of leaving a hole past the data.
+ *
+ * New blocks are normally left unzeroed within the range, which the write
+ * overwrites. A write that may copy less than the range (e.g. from a pipe)
+ * passes short = true to have them zeroed in full; see file_write_end().
+ *
+ * @param fs      file system context.
+ * @param ino     the inode number of the file.
+ * @param offset  offset of the range.
+ * @param size    size of the range in bytes.
+ * @param short_  true if the write may copy less than the whole range.
+ * @param avail   pointer to the variable that receives the number of bytes
+ *                from offset on that can be written.
+ * @return        0 if at least part of the range can be written; -errno
+ *                otherwise (the file is unchanged).
+ */
+int file_write_begin(fs_ctx *fs, a1fs_ino_t ino, uint64_t offset, uint64_t size, bool short_, uint64_t *avail) {
+    struct a1fs_inode *inode = inode_at(fs, ino);
+    uint64_t old_size = inode->size;
+
+    if (file_is_inline(inode)) {
+        if (offset + size <= A1FS_INLINE_DATA_MAX) {
+            if (offset + size > old_size) file_resize(fs, ino, offset + size);
+            *avail = size;
+            return 0;
+        }
+        int ret = file_uninline(fs, ino);
+        if (ret != 0) return ret;
+    }
+
+    if (offset + size > old_size) {
+        int ret = file_resize(fs, ino, offset + size);
+        if (ret != 0) return ret;
+    }
+
+    int ret = file_alloc(fs, ino, offset, size, !short_, avail);
+    if (ret != 0) {
+        // The file only grows as far as blocks could be allocated
+        file_write_end(fs, ino, old_size, offset, *avail);
+        if (*avail == 0) return ret;
+    }
+    return 0;
+}
+
+
+/**
+ * Read data from a file; the range is cut short at the end of the file and
+ * holes read as zeros. The caller holds the inode lock. The extents are looked
+ * up through cursor (the cursor of an open file, or NULL for the shared one).
+ *
+ * @return  number of bytes read.
+ */
+size_t file_read(fs_ctx *fs, a1fs_ino_t ino, extent_cursor *cursor, void *buf, size_t size, uint64_t offset) {
+    struct a1fs_inode *inode = inode_at(fs, ino);
+    if (offset >= inode->size) {
+        size = 0;
+    } else if (size > inode->size - offset) {
+        size = inode->size - offset;
+    }
+
+    // Copy extent by extent; each piece is contiguous in the image
+    size_t done = 0;
+    while (done < size) {
+        size_t n;
+        void *data = file_data(fs, ino, cursor, offset + done, &n);
+        if (n > size - done) n = size - done;
+
+        if (data != NULL) {
+            memcpy(buf + done, data, n);
+        } else {
+            memset(buf + done, 0, n);// hole
+        }
+        done += n;
+    }
+    return done;
+}
+
+
+/**
+ * Write data to a file, extending it if the range goes past its end, and
+ * update its mtime. The caller holds the inode lock for writing. The extents
+ * are looked up through cursor as in file_read().
+ *
+ * @return  number of bytes written (short only when the file system fills
+ *          up); -errno if nothing could be written.
+ */
+int file_write(fs_ctx *fs, a1fs_ino_t ino, extent_cursor *cursor, const void *buf, size_t size, uint64_t offset) {
+    if (size == 0) return 0;
+
+    // Allocate the blocks of the range up front (any gap before it stays a
+    // hole), so that the write either fails with nothing changed or copies
+    // all of the data that fits
+    uint64_t avail;
+    int ret = file_write_begin(fs, ino, offset, size, false, &avail);
+    if (ret != 0) return ret;
+    size = avail;
+
+    // Copy extent by extent; each piece is contiguous in the image
+    size_t done = 0;
+    while (done < size) {
+        size_t n;
+        void *data = file_data(fs, ino, cursor, offset + done, &n);
+        if (data == NULL) return -EIO;
+        if (n > size - done) n = size - done;
+
+        memcpy(data, buf + done, n);
+        done += n;
+    }
+
+    if (clock_gettime(CLOCK_REALTIME, &inode_at(fs, ino)->mtime) == -1) {
+        perror("clock_gettime");
+        return -ENOSYS;
+    }
+    return size;
+}
+
+
+/**
+ * Allocate or deallocate space for a range of a file (see a1fs_fallocate())
+ * and update its mtime. The caller holds the inode lock for writing.
+ *
+ * @return  0 on success; -errno on error.
+ */
+int file_fallocate(fs_ctx *fs, a1fs_ino_t ino, int mode, uint64_t offset, uint64_t length) {
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) return -EOPNOTSUPP;
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)) return -EOPNOTSUPP;
+
+    struct a1fs_inode *inode = inode_at(fs, ino);
+    uint64_t end = offset + length;
+    if (align_up(end, A1FS_BLOCK_SIZE) / A1FS_BLOCK_SIZE > UINT32_MAX) return -EFBIG;
+
+    int ret;
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        if (offset >= inode->size) return 0;
+        if (end > inode->size) end = inode->size;
+        ret = file_punch(fs, ino, offset, end - offset);
+    } else {
+        ret = file_uninline(fs, ino);
+        if (ret != 0) return ret;
+
+        // Fail up front rather than allocate only part of the range
+        uint64_t holes = file_unmapped(fs, ino, offset / A1FS_BLOCK_SIZE,
+                                       align_up(end, A1FS_BLOCK_SIZE) / A1FS_BLOCK_SIZE);
+        if (holes > data_free_blocks(fs)) return -ENOSPC;
+
+        uint64_t avail;
+        ret = file_alloc(fs, ino, offset, end - offset, false, &avail);
+        if ((ret == 0) && !(mode & FALLOC_FL_KEEP_SIZE) && (end > inode->size)) {
+            ret = file_resize(fs, ino, end);
+        }
+    }
+    if (ret != 0) return ret;
+
+    if (clock_gettime(CLOCK_REALTIME, &inode->mtime) == -1) {
+        perror("clock_gettime");
+        return -ENOSYS;
+    }
+    return 0;
+}
+
+
+/**
+ * Number of fixed-size entries at which a directory gets a hashed index. A
+ * directory of variable-length entries gets one at the same size in bytes.
+ */
+#define DIR_INDEX_THRESHOLD 64
+
+/** Largest number of blocks an indexed directory grows by at once. */
+#define DIR_MAX_GROW 256
+
+/**
+ * A directory is compacted when it has more than this many times the blocks
+ * its live entries need, i.e. when removed entries ("tombstones") and unused
+ * space make up most of what lookups and readdir have to scan.
+ */
+#define DIR_COMPACT_RATIO 4
+
+
+/** Check if the file system uses variable-length directory entries. */
+bool var_dentries(fs_ctx *fs) {
+    struct a1fs_superblock *sp = (struct a1fs_superblock *)(fs->image);
+    return (sp->s_features & A1FS_FEATURE_VAR_DENTRY) != 0;
+}
+
+
+/** Number of bytes in a unit of dentry numbers. */
+size_t dentry_unit(fs_ctx *fs) {
+    return var_dentries(fs) ? A1FS_VDENTRY_ALIGN : sizeof(a1fs_dentry);
+}
+
+
+/** Number of bytes an entry with the given name adds to the directory size. */
+size_t dentry_len(fs_ctx *fs, const char *name) {
+    return var_dentries(fs) ? A1FS_VDENTRY_LEN(strlen(name)) : sizeof(a1fs_dentry);
+}
+
+
+/** Get the name of a directory entry (of either format). */
+char *dentry_name(fs_ctx *fs, struct a1fs_dentry *entry) {
+    return var_dentries(fs) ? ((a1fs_vdentry *)entry)->name : entry->name;
+}
+
+
+/** Check if a directory entry slot is unused (never used or a " " tombstone). */
+bool dentry_is_free(fs_ctx *fs, struct a1fs_dentry *entry) {
+    if (var_dentries(fs)) return entry->ino == 0;
+    return (entry->name[0] == '\0') || (strcmp(entry->name, " ") == 0);
+}
+
+
+/**
+ * Get the number of bytes a new entry can take in or after a directory entry:
+ * a whole free slot, or the unused space after a variable-length entry.
+ *
+ * @return  number of bytes; 0 if there is no room for any entry.
+ */
+size_t dentry_room(fs_ctx *fs, struct a1fs_dentry *entry) {
+    if (!var_dentries(fs)) return dentry_is_free(fs, entry) ? sizeof(a1fs_dentry) : 0;
+
+    a1fs_vdentry *v = (a1fs_vdentry *)entry;
+    size_t room = (v->ino == 0) ? v->rec_len : v->rec_len - A1FS_VDENTRY_LEN(v->name_len);
+    return (room >= A1FS_VDENTRY_LEN(1)) ? room : 0;
+}
+
+
+/**
+ * Get the next entry of a directory extent.
+ *
+ * @param fs      file system context.
+ * @param extent  the directory extent.
+ * @param entry   the current entry; NULL to get the first one.
+ * @return        the next entry; NULL at the end of the extent (or right away
+ *                for a freed extent slot; see dir_remove_entry()).
+ */
+struct a1fs_dentry *dentry_next(fs_ctx *fs, struct a1fs_extent *extent, struct a1fs_dentry *entry) {
+    if (entry == NULL) return (extent->count != 0) ? dentry_at(fs, extent, 0) : NULL;
+
+    void *next = (void *)entry + (var_dentries(fs) ? ((a1fs_vdentry *)entry)->rec_len : sizeof(a1fs_dentry));
+    void *end = block_at(fs, extent->start + extent->count);
+    return (next < end) ? next : NULL;
+}
+
+
+/** Number of low bits of a directory position that hold the offset within an extent. */
+#define DIR_POS_SHIFT 48
+
+
+/** Directory entry visitor; see dir_iterate(). Returns false to stop. */
+typedef bool (*dentry_visit_fn)(fs_ctx *fs, struct a1fs_dentry *entry, off_t next, void *arg);
+
+
+/**
+ * Visit the entries of a directory in the order they are stored, from a
+ * position on, until fn returns false. Implements readdir() offsets.
+ *
+ * A position is the index of a directory extent (in the high bits) and an
+ * offset in dentry units within it; 0 is the start of the directory. fn gets
+ * the position right after each entry, so a listing resumed from there goes
+ * on with the next entry without going over the ones before it. Positions
+ * stay valid for as long as the directory is open: a live entry never moves
+ * and an extent never changes its index while the directory has open handles
+ * (an emptied extent leaves its slot empty, and compaction waits for the last
+ * handle to be released; see dir_tidy()).
+ *
+ * @param fs    file system context.
+ * @param dir   the directory inode.
+ * @param pos   position to start from.
+ * @param fn    function to call for each entry.
+ * @param arg   argument passed to fn.
+ * @return      true if all entries were visited; false if fn stopped.
+ */
+bool dir_iterate(fs_ctx *fs, struct a1fs_inode *dir, off_t pos, dentry_visit_fn fn, void *arg) {
+    if (pos < 0) return true;
+    size_t unit = dentry_unit(fs);
+    int first = pos >> DIR_POS_SHIFT;
+    uint64_t skip = (pos & ((1l << DIR_POS_SHIFT) - 1)) * unit;
+
+    for (int j = first; j < dir->extent_used; j++) {
+        struct a1fs_extent *extent = extent_at(fs, dir, j);
+        void *base = block_at(fs, extent->start);
+        struct a1fs_dentry *entry = dentry_next(fs, extent, NULL);
+        if ((j == first) && (skip != 0)) {
+            if (skip >= (uint64_t)extent->count * A1FS_BLOCK_SIZE) continue;
+            // Entries are chained within their block; the one at the
+            // position may have been merged into the one before it
+            entry = base + (skip & ~(uint64_t)(A1FS_BLOCK_SIZE - 1));
+            while ((entry != NULL) && ((void *)entry < base + skip)) entry = dentry_next(fs, extent, entry);
+        }
+
+        for (; entry != NULL; entry = dentry_next(fs, extent, entry)) {
+            if (dentry_is_free(fs, entry)) continue;
+            struct a1fs_dentry *next = dentry_next(fs, extent, entry);
+            off_t next_pos = (off_t)(j + 1) << DIR_POS_SHIFT;
+            if (next != NULL) next_pos = ((off_t)j << DIR_POS_SHIFT) | (off_t)(((void *)next - base) / unit);
+            if (!fn(fs, entry, next_pos, arg)) return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Store a new directory entry in the room of an existing one (see
+ * dentry_room()), which must be large enough. A variable-length entry that is
+ * in use is split: the new entry takes all of its unused space.
+ *
+ * @return  the new entry.
+ */
+struct a1fs_dentry *dentry_put(fs_ctx *fs, struct a1fs_dentry *entry, const char *name, a1fs_ino_t ino) {
+    if (!var_dentries(fs)) {
+        strcpy(entry->name, name);
+        entry->ino = ino;
+        return entry;
+    }
+
+    a1fs_vdentry *v = (a1fs_vdentry *)entry;
+    if (v->ino != 0) {
+        uint16_t used = A1FS_VDENTRY_LEN(v->name_len);
+        a1fs_vdentry *split = (void *)v + used;
+        split->rec_len = v->rec_len - used;
+        v->rec_len = used;
+        v = split;
+    }
+    v->ino = ino;
+    v->name_len = strlen(name);
+    v->pad = 0;
+    strcpy(v->name, name);
+    return (struct a1fs_dentry *)v;
+}
+
+
+/**
+ * Remove a directory entry. A fixed-size entry becomes a " " tombstone; a
+ * variable-length one is merged into the previous entry of its block, or
+ * marked free if it is the first one.
+ *
+ * @return  the entry that now holds the space of the removed one.
+ */
+struct a1fs_dentry *dentry_clear(fs_ctx *fs, struct a1fs_dentry *entry) {
+    if (!var_dentries(fs)) {
+        strcpy(entry->name, " ");
+        entry->ino = 0;
+        return entry;
+    }
+
+    a1fs_vdentry *v = (a1fs_vdentry *)entry;
+    void *data = block_at(fs, 0);
+    a1fs_vdentry *cur = data + (((void *)v - data) & ~(size_t)(A1FS_BLOCK_SIZE - 1));
+    a1fs_vdentry *prev = NULL;
+    while (cur != v) {
+        prev = cur;
+        cur = (void *)cur + cur->rec_len;
+    }
+    if (prev == NULL) {
+        v->ino = 0;
+        v->name_len = 0;
+        v->name[0] = '\0';
+        return entry;
+    }
+    prev->rec_len += v->rec_len;
+    return (struct a1fs_dentry *)prev;
+}
+
+
+/** Check if a directory extent holds no entries. */
+bool dir_extent_empty(fs_ctx *fs, struct a1fs_extent *extent) {
+    for (struct a1fs_dentry *e = dentry_next(fs, extent, NULL); e != NULL; e = dentry_next(fs, extent, e)) {
+        if (!dentry_is_free(fs, e)) return false;
+    }
+    return true;
+}
+
+
+/** Get a pointer to a directory entry by its dentry number. */
+struct a1fs_dentry *dentry_by_no(fs_ctx *fs, uint64_t no) {
+    return (struct a1fs_dentry *)(block_at(fs, 0) + no * dentry_unit(fs));
+}
+
+
+/** Get the dentry number of a directory entry. */
+uint64_t dentry_no(fs_ctx *fs, struct a1fs_dentry *entry) {
+    return ((void *)entry - block_at(fs, 0)) / dentry_unit(fs);
+}
+
+
+/** FNV-1a hash of a file name, used by the hashed directory index. */
+uint32_t name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)name; *c; c++) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/** Get a pointer to the hashed index header of a directory. */
+struct a1fs_dir_index *dir_index_at(fs_ctx *fs, struct a1fs_inode *dir) {
+    return (struct a1fs_dir_index *)block_at(fs, dir->index_pt);
+}
+
+
+/**
+ * Find the bucket of the entry with the given name in a directory index.
+ *
+ * @param fs     file system context.
+ * @param index  the directory index.
+ * @param name   the name of the entry.
+ * @param hash   name_hash() of the name.
+ *
+ * @return       pointer to the bucket; NULL if there is no such entry.
+ */
+a1fs_dir_bucket *dir_index_find(fs_ctx *fs, struct a1fs_dir_index *index, const char *name, uint32_t hash) {
+    a1fs_dir_bucket *buckets = (a1fs_dir_bucket *)(index + 1);
+    uint32_t mask = index->nbuckets - 1;
+
+    for (uint32_t n = 0, i = hash & mask; n < index->nbuckets; n++, i = (i + 1) & mask) {
+        if (buckets[i].slot == 0) {
+            return NULL;
+        }
+        if ((buckets[i].slot != A1FS_DIR_BUCKET_DELETED) && (buckets[i].hash == hash) &&
+            (strcmp(dentry_name(fs, dentry_by_no(fs, buckets[i].slot - 1)), name) == 0)) {
+            return &buckets[i];
+        }
+    }
+    return NULL;
+}
+
+
+/** Insert an entry into a directory index. There must be a free bucket. */
+void dir_index_put(struct a1fs_dir_index *index, uint32_t hash, uint64_t no) {
+    a1fs_dir_bucket *buckets = (a1fs_dir_bucket *)(index + 1);
+    uint32_t mask = index->nbuckets - 1;
+
+    uint32_t i = hash & mask;
+    while ((buckets[i].slot != 0) && (buckets[i].slot != A1FS_DIR_BUCKET_DELETED)) {
+        i = (i + 1) & mask;
+    }
+    if (buckets[i].slot == A1FS_DIR_BUCKET_DELETED) {
+        index->ndeleted--;
+    }
+    buckets[i].hash = hash;
+    buckets[i].slot = no + 1;
+    index->nlive++;
+}
+
+
+/** Remember a free dentry slot in a directory index, if there is room. */
+void dir_index_push_free(struct a1fs_dir_index *index, uint64_t no) {
+    if (index->nfree < sizeof(index->free_slots) / sizeof(index->free_slots[0])) {
+        index->free_slots[index->nfree++] = no;
+    }
+}
+
+
+/** Forget the free slots in the dentry number range [first, last) of a directory index. */
+void dir_index_forget(struct a1fs_dir_index *index, uint64_t first, uint64_t last) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < index->nfree; i++) {
+        if ((index->free_slots[i] < first) || (index->free_slots[i] >= last)) {
+            index->free_slots[n++] = index->free_slots[i];
+        }
+    }
+    index->nfree = n;
+}
+
+
+/** Free the hashed index of a directory (the directory itself is unchanged). */
+void dir_index_free(fs_ctx *fs, struct a1fs_inode *dir) {
+    if (dir->index_blocks == 0) return;
+
+    struct a1fs_extent extent;
+    extent.start = dir->index_pt;
+    extent.count = dir->index_blocks;
+    rm_multiple_data_bitmap(fs, extent);
+    dir->index_blocks = 0;
+}
+
+
+/**
+ * Build (or rebuild) the hashed index of a directory.
+ *
+ * The entries are taken from the old index if there is one, and from a scan of
+ * the directory blocks otherwise. The index is stored in a new contiguous run
+ * of blocks; the old one is freed.
+ *
+ * @param fs        file system context.
+ * @param dir       the directory inode.
+ * @param nbuckets  number of buckets (a power of 2, at least one block); more
+ *                  are used if a scan finds too many entries for them.
+ *
+ * @return          0 on success; -ENOSPC if there is no room for the index
+ *                  (the directory is left as it was).
+ */
+int dir_index_build(fs_ctx *fs, struct a1fs_inode *dir, uint32_t nbuckets) {
+    if (dir->index_blocks == 0) {
+        // a directory of short variable-length entries may hold many of them
+        uint32_t nentries = 0;
+        for (int j = 0; j < dir->extent_used; j++) {
+            struct a1fs_extent *cur_extent = extent_at(fs, dir, j);
+            struct a1fs_dentry *cur_entry = NULL;
+            while ((cur_entry = dentry_next(fs, cur_extent, cur_entry)) != NULL) {
+                if (!dentry_is_free(fs, cur_entry)) nentries++;
+            }
+        }
+        while (nbuckets < nentries * 2) nbuckets <<= 1;
+    }
+
+    int blocks = 1 + nbuckets / A1FS_DIR_BUCKETS_PER_BLOCK;
+    a1fs_blk_t start;
+    if (set_run_bitmap(fs, blocks, &start) == -1) {
+        return -ENOSPC;
+    }
+    struct a1fs_dir_index *index = (struct a1fs_dir_index *)block_at(fs, start);
+    memset(index, 0, blocks * A1FS_BLOCK_SIZE);
+    index->magic = A1FS_DIR_INDEX_MAGIC;
+    index->nbuckets = nbuckets;
+
+    if (dir->index_blocks != 0) {
+        struct a1fs_dir_index *old = dir_index_at(fs, dir);
+        a1fs_dir_bucket *old_buckets = (a1fs_dir_bucket *)(old + 1);
+        for (uint32_t i = 0; i < old->nbuckets; i++) {
+            if ((old_buckets[i].slot != 0) && (old_buckets[i].slot != A1FS_DIR_BUCKET_DELETED)) {
+                dir_index_put(index, old_buckets[i].hash, old_buckets[i].slot - 1);
+            }
+        }
+        index->tail = old->tail;
+        index->tail_left = old->tail_left;
+        index->nfree = old->nfree;
+        memcpy(index->free_slots, old->free_slots, old->nfree * sizeof(old->free_slots[0]));
+        dir_index_free(fs, dir);
+    } else {
+        for (int j = 0; j < dir->extent_used; j++) {
+            struct a1fs_extent *cur_extent = extent_at(fs, dir, j);
+            struct a1fs_dentry *cur_entry = NULL;
+            while ((cur_entry = dentry_next(fs, cur_extent, cur_entry)) != NULL) {
+                if (!dentry_is_free(fs, cur_entry)) {
+                    dir_index_put(index, name_hash(dentry_name(fs, cur_entry)), dentry_no(fs, cur_entry));
+                }
+                if (dentry_room(fs, cur_entry) != 0) {
+                    dir_index_push_free(index, dentry_no(fs, cur_entry));
+                }
+            }
+        }
+    }
+
+    dir->index_pt = start;
+    dir->index_blocks = blocks;
+    return 0;
+}
+
+
+/**
+ * Add a new extent of (up to) want contiguous blocks to a directory. Falls back
+ * to smaller extents if there is no free run of the requested length.
+ *
+ * @param fs    file system context.
+ * @param dir   the directory inode.
+ * @param want  preferred number of blocks.
+ *
+ * The extent is added after the last one; once the extent block is full, it
+ * takes the first slot freed by dir_remove_entry() instead.
+ *
+ * @return      pointer to the new (zeroed) extent; NULL if out of space.
+ */
+struct a1fs_extent *dir_grow(fs_ctx *fs, struct a1fs_inode *dir, int want) {
+    int slot = dir->extent_used;
+    if ((dir->extent_used + 1) * sizeof(a1fs_extent) > A1FS_BLOCK_SIZE) {
+        for (slot = 0; (slot < dir->extent_used) && (extent_at(fs, dir, slot)->count != 0); slot++);
+        if (slot == dir->extent_used) {
+            return NULL;
+        }
+    }
+    if (dir->extent_used == 0) {
+        if (set_single_bitmap(fs, &dir->extend_pt, 0) == -1) {
+            return NULL;
+        }
+    }
+
+    a1fs_blk_t start;
+    while (set_run_bitmap(fs, want, &start) == -1) {
+        if (want == 1) {
+            if (dir->extent_used == 0) {
+                rm_single_bitmap(fs, dir->extend_pt, 0);
+            }
+            return NULL;
+        }
+        want /= 2;
+    }
+
+    struct a1fs_extent *new_extent = extent_at(fs, dir, slot);
+    new_extent->start = start;
+    new_extent->count = want;
+    new_extent->pad = 0;
+    memset(block_at(fs, new_extent->start), 0, A1FS_BLOCK_SIZE*new_extent->count);
+    if (var_dentries(fs)) {
+        // each block starts out as a single free entry
+        for (uint32_t i = 0; i < new_extent->count; i++) {
+            a1fs_vdentry *first = block_at(fs, new_extent->start + i);
+            first->rec_len = A1FS_BLOCK_SIZE;
+        }
+    }
+    if (slot == dir->extent_used) dir->extent_used ++;
+    return new_extent;
+}
+
+
+/**
+ * Get room for a new entry in an indexed directory: a recently freed slot if
+ * one is known, otherwise the next never used space at the end of the
+ * directory. The directory is grown if needed.
+ *
+ * @param fs    file system context.
+ * @param dir   the directory inode.
+ * @param len   number of bytes the new entry needs (see dentry_len()).
+ *
+ * @return      pointer to the entry to store the new one in with dentry_put();
+ *              NULL if out of space.
+ */
+struct a1fs_dentry *dir_index_get_slot(fs_ctx *fs, struct a1fs_inode *dir, size_t len) {
+    struct a1fs_dir_index *index = dir_index_at(fs, dir);
+
+    while (index->nfree > 0) {
+        struct a1fs_dentry *entry = dentry_by_no(fs, index->free_slots[--index->nfree]);
+        if (dentry_room(fs, entry) >= len) {
+            return entry;
+        }
+    }
+
+    for (;;) {
+        // skip the entries at the tail that have no room left; the rest of a
+        // block too small for this entry may still fit a shorter one later
+        while (index->tail_left != 0) {
+            struct a1fs_dentry *entry = dentry_by_no(fs, index->tail);
+            size_t room = dentry_room(fs, entry);
+            if (room >= len) {
+                return entry;
+            }
+            if (room != 0) {
+                dir_index_push_free(index, index->tail);
+            }
+            uint32_t skip = var_dentries(fs) ? ((a1fs_vdentry *)entry)->rec_len / A1FS_VDENTRY_ALIGN : 1;
+            index->tail += skip;
+            index->tail_left -= skip;
+        }
+
+        // grow geometrically so that large directories need few extents
+        int want = dir->size / A1FS_BLOCK_SIZE;
+        if (want < 1) want = 1;
+        if (want > DIR_MAX_GROW) want = DIR_MAX_GROW;
+
+        struct a1fs_extent *new_extent = dir_grow(fs, dir, want);
+        if (new_extent == NULL) {
+            return NULL;
+        }
+        index->tail = new_extent->start * A1FS_BLOCK_SIZE / dentry_unit(fs);
+        index->tail_left = new_extent->count * A1FS_BLOCK_SIZE / dentry_unit(fs);
+    }
+}
+
+
+/**
+ * Find the entry with the given name in a directory.
+ *
+ * @param fs    file system context.
+ * @param dir   the directory inode.
+ * @param name  the name of the entry.
+ *
+ * @return      pointer to the entry; NULL if there is no such entry.
+ */
+struct a1fs_dentry *dir_find_entry(fs_ctx *fs, struct a1fs_inode *dir, const char *name) {
+    if (dir->index_blocks != 0) {
+        a1fs_dir_bucket *bucket = dir_index_find(fs, dir_index_at(fs, dir), name, name_hash(name));
+        return (bucket == NULL) ? NULL : dentry_by_no(fs, bucket->slot - 1);
+    }
+
+    for (int j = 0; j < dir->extent_used; j++) {
+        struct a1fs_extent *cur_extent = extent_at(fs, dir, j);
+        struct a1fs_dentry *cur_entry = NULL;
+        while ((cur_entry = dentry_next(fs, cur_extent, cur_entry)) != NULL) {
+            if (!dentry_is_free(fs, cur_entry) && (strcmp(dentry_name(fs, cur_entry), name) == 0)) {
+                return cur_entry;
+            }
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Add an entry to a directory.
+ *
+ * Small directories are searched for room and grow one block at a time. Once
+ * a directory holds DIR_INDEX_THRESHOLD entries it gets a hashed index, which
+ * also tracks free slots, so that insertion doesn't depend on the directory
+ * size.
+ *
+ * @param fs    file system context.
+ * @param dir   the directory inode.
+ * @param name  the name of the new entry.
+ * @param ino   the inode number of the new entry.
+ *
+ * @return      0 on success; -ENOSPC if the directory can't be extended.
+ */
+int dir_add_entry(fs_ctx *fs, struct a1fs_inode *dir, const char *name, a1fs_ino_t ino) {
+    struct a1fs_dentry *slot = NULL;
+    size_t len = dentry_len(fs, name);
+
+    if (dir->index_blocks != 0) {
+        // keep the load factor under 3/4, rebuilding at twice the live entries
+        struct a1fs_dir_index *index = dir_index_at(fs, dir);
+        if ((index->nlive + index->ndeleted + 1) * 4 > index->nbuckets * 3) {
+            uint32_t nbuckets = A1FS_DIR_BUCKETS_PER_BLOCK;
+            while (nbuckets < (index->nlive + 1) * 2) nbuckets <<= 1;
+            if ((dir_index_build(fs, dir, nbuckets) != 0) &&
+                (index->nlive + index->ndeleted + 1 >= index->nbuckets)) {
+                // the index is full and can't grow; fall back to scanning
+                dir_index_free(fs, dir);
+            }
+        }
+    }
+
+    if (dir->index_blocks != 0) {
+        slot = dir_index_get_slot(fs, dir, len);
+        if (slot == NULL) {
+            return -ENOSPC;
+        }
+    } else {
+        for (int j = 0; (j < dir->extent_used) && (slot == NULL); j++) {
+            struct a1fs_extent *cur_extent = extent_at(fs, dir, j);
+            struct a1fs_dentry *cur_entry = NULL;
+            while ((cur_entry = dentry_next(fs, cur_extent, cur_entry)) != NULL) {
+                if (dentry_room(fs, cur_entry) >= len) {
+                    slot = cur_entry;
+                    break;
+                }
+            }
+        }
+        /** no room, add a new block to the directory */
+        if (slot == NULL) {
+            struct a1fs_extent *new_extent = dir_grow(fs, dir, 1);
+            if (new_extent == NULL) {
+                return -ENOSPC;
+            }
+            slot = dentry_at(fs, new_extent, 0);
+        }
+    }
+
+    struct a1fs_dentry *new_entry = dentry_put(fs, slot, name, ino);
+    dir->size += len;
+
+    if (dir->index_blocks != 0) {
+        struct a1fs_dir_index *index = dir_index_at(fs, dir);
+        dir_index_put(index, name_hash(name), dentry_no(fs, new_entry));
+        if ((index->tail_left != 0) && (dentry_no(fs, slot) == index->tail)) {
+            // a variable-length entry split off the tail takes the rest of the block
+            index->tail_left -= dentry_no(fs, new_entry) - index->tail;
+            index->tail = dentry_no(fs, new_entry);
+        } else if (dentry_room(fs, new_entry) != 0) {
+            dir_index_push_free(index, dentry_no(fs, new_entry));
+        }
+    } else if (dir->size >= DIR_INDEX_THRESHOLD * sizeof(a1fs_dentry)) {
+        // if there is no room for the index, the directory just stays unindexed
+        dir_index_build(fs, dir, A1FS_DIR_BUCKETS_PER_BLOCK);
+    }
+    return 0;
+}
+
+
+/**
+ * Compact a directory: move its live entries to the front of the directory,
+ * packed together in the order they are found, and free the blocks left
+ * unused. The hashed index (if any) is rebuilt, since the entries move.
+ *
+ * The entries are moved in place; an entry never moves past the position it
+ * is read from, so nothing is overwritten before it has been moved.
+ *
+ * Entries and extents change their positions (see dir_iterate()), so the
+ * directory must not be open.
+ *
+ * @param fs    file system context.
+ * @param dir   the directory inode; must have at least one entry.
+ */
+void dir_compact(fs_ctx *fs, struct a1fs_inode *dir) {
+    bool var = var_dentries(fs);
+
+    // drop the extent slots freed by dir_remove_entry()
+    int used = 0;
+    for (int j = 0; j < dir->extent_used; j++) {
+        if (extent_at(fs, dir, j)->count != 0) *extent_at(fs, dir, used++) = *extent_at(fs, dir, j);
+    }
+    dir->extent_used = used;
+
+    // destination: extent, block within it, and offset within the block
+    int dext = 0;
+    uint32_t dblk = 0;
+    size_t doff = 0;
+    a1fs_vdentry *last = NULL;
+    void *dst_block = block_at(fs, extent_at(fs, dir, 0)->start);
+
+    for (int j = 0; j < dir->extent_used; j++) {
+        struct a1fs_extent *cur_extent = extent_at(fs, dir, j);
+        struct a1fs_dentry *next = dentry_next(fs, cur_extent, NULL);
+        while (next != NULL) {
+            struct a1fs_dentry *cur_entry = next;
+            next = dentry_next(fs, cur_extent, cur_entry);
+            if (dentry_is_free(fs, cur_entry)) continue;
+
+            size_t len = var ? A1FS_VDENTRY_LEN(((a1fs_vdentry *)cur_entry)->name_len) : sizeof(a1fs_dentry);
+            if (doff + len > A1FS_BLOCK_SIZE) {
+                // the last entry of a block takes the rest of it
+                if (var) last->rec_len = A1FS_BLOCK_SIZE - ((void *)last - dst_block);
+                if (++dblk == extent_at(fs, dir, dext)->count) {
+                    dext++;
+                    dblk = 0;
+                }
+                doff = 0;
+                dst_block = block_at(fs, extent_at(fs, dir, dext)->start + dblk);
+            }
+
+            void *dst = dst_block + doff;
+            memmove(dst, cur_entry, len);
+            if (var) {
+                last = dst;
+                last->rec_len = len;
+            }
+            doff += len;
+        }
+    }
+
+    // close the last block
+    if (var) {
+        last->rec_len = A1FS_BLOCK_SIZE - ((void *)last - dst_block);
+    } else {
+        memset(dst_block + doff, 0, A1FS_BLOCK_SIZE - doff);
+    }
+
+    // free the blocks after it
+    struct a1fs_extent *cur_extent = extent_at(fs, dir, dext);
+    if (dblk + 1 < cur_extent->count) {
+        struct a1fs_extent tail = {0};
+        tail.start = cur_extent->start + dblk + 1;
+        tail.count = cur_extent->count - (dblk + 1);
+        rm_multiple_data_bitmap(fs, tail);
+        cur_extent->count = dblk + 1;
+    }
+    for (int j = dext + 1; j < dir->extent_used; j++) {
+        rm_multiple_data_bitmap(fs, *extent_at(fs, dir, j));
+    }
+    dir->extent_used = dext + 1;
+
+    if (dir->index_blocks != 0) {
+        // the bucket count is derived from the number of entries found
+        dir_index_free(fs, dir);
+        dir_index_build(fs, dir, A1FS_DIR_BUCKETS_PER_BLOCK);
+    }
+}
+
+
+/**
+ * Remove the entry with the given name from a directory (see dentry_clear()).
+ * A directory extent left with no entries is freed; its slot stays in the
+ * extent block, empty, so that the extents after it keep their indexes (and
+ * readdir positions in them stay valid; see dir_iterate()). Empty slots at
+ * the end are dropped.
+ *
+ * @param fs    file system context.
+ * @param dir   the directory inode.
+ * @param name  the name of the entry.
+ *
+ * @return      0 on success; -ENOENT if there is no such entry.
+ */
+int dir_remove_entry(fs_ctx *fs, struct a1fs_inode *dir, const char *name) {
+    struct a1fs_dir_index *index = NULL;
+    struct a1fs_dentry *entry;
+    if (dir->index_blocks != 0) {
+        index = dir_index_at(fs, dir);
+        a1fs_dir_bucket *bucket = dir_index_find(fs, index, name, name_hash(name));
+        if (bucket == NULL) {
+            return -ENOENT;
+        }
+        entry = dentry_by_no(fs, bucket->slot - 1);
+        bucket->slot = A1FS_DIR_BUCKET_DELETED;
+        index->nlive--;
+        index->ndeleted++;
+    } else {
+        entry = dir_find_entry(fs, dir, name);
+        if (entry == NULL) {
+            return -ENOENT;
+        }
+    }
+
+    uint64_t no = dentry_no(fs, entry);
+    dir->size -= dentry_len(fs, name);
+    uint64_t holder = dentry_no(fs, dentry_clear(fs, entry));
+    if ((index != NULL) && (holder != no)) {
+        // the entry was merged into the previous one and no longer exists
+        dir_index_forget(index, no, no + 1);
+        if ((index->tail_left != 0) && (index->tail == no)) {
+            index->tail_left += no - holder;
+            index->tail = holder;
+        }
+    }
+
+    // find the extent holding the entry
+    struct a1fs_extent *cur_extent = NULL;
+    uint64_t first = 0, last = 0;
+    for (int j = 0; j < dir->extent_used; j++) {
+        cur_extent = extent_at(fs, dir, j);
+        first = cur_extent->start * A1FS_BLOCK_SIZE / dentry_unit(fs);
+        last = first + cur_extent->count * A1FS_BLOCK_SIZE / dentry_unit(fs);
+        if ((no >= first) && (no < last)) break;
+    }
+
+    // if the extent has no entries left, delete it
+    if (!dir_extent_empty(fs, cur_extent)) {
+        if (index != NULL) {
+            dir_index_push_free(index, holder);
+        }
+        return 0;
+    }
+    if (index != NULL) {
+        // forget the free slots that belong to the extent
+        dir_index_forget(index, first, last);
+        if ((index->tail >= first) && (index->tail < last)) {
+            index->tail_left = 0;
+        }
+    }
+    rm_multiple_data_bitmap(fs, *cur_extent);
+    cur_extent->start = 0;
+    cur_extent->count = 0;
+    while ((dir->extent_used != 0) && (extent_at(fs, dir, dir->extent_used - 1)->count == 0)) {
+        dir->extent_used --;
+    }
+    if (dir->extent_used == 0) {
+        // free extent block pointer
+        rm_single_bitmap(fs, dir->extend_pt, 0);
+    }
+    return 0;
+}
+
+
+/**
+ * Compact a directory left mostly empty by removed entries (see
+ * DIR_COMPACT_RATIO), unless it is open: compaction moves entries, which
+ * would make an open handle skip or repeat some of them. The last handle to
+ * be released calls this again. The caller holds the directory lock for
+ * writing.
+ *
+ * @param fs   file system context.
+ * @param ino  the inode number of the directory.
+ */
+void dir_tidy(fs_ctx *fs, a1fs_ino_t ino) {
+    struct a1fs_inode *dir = inode_at(fs, ino);
+    if ((fs->open_count[ino] != 0) || (dir->size == 0)) return;
+
+    uint64_t blocks = 0;
+    for (int j = 0; j < dir->extent_used; j++) {
+        blocks += extent_at(fs, dir, j)->count;
+    }
+    if (blocks > DIR_COMPACT_RATIO * (dir->size / A1FS_BLOCK_SIZE + 1)) {
+        dir_compact(fs, dir);
+    }
+}
+
+
+/**
+ * Create a new inode and link it into a directory. The caller holds the lock
+ * of the directory for writing.
+ *
+ * @param fs      file system context.
+ * @param parent  the directory inode.
+ * @param name    the name of the new entry.
+ * @param mode    file mode bits (including the file type).
+ * @param links   initial link count of the new inode.
+ * @param ino     pointer to the variable that receives the new inode number.
+ *
+ * @return        0 on success; -ENOSPC if out of inodes or the directory
+ *                can't be extended.
+ */
+int node_create(fs_ctx *fs, struct a1fs_inode *parent, const char *name, mode_t mode, uint32_t links,
+                a1fs_ino_t *ino) {
+    /** find avaliable space in inode bitmap and update inode bitmap. */
+    int new_ino;
+    if (set_inode_bitmap(fs, &new_ino) < 0) return -ENOSPC;
+
+    /** add new a1fs_dentry to parent directory block. */
+    int ret = dir_add_entry(fs, parent, name, new_ino);
+    if (ret != 0) {
+        rm_inode_bitmap(fs, new_ino);
+        return ret;
+    }
+
+    /** create inode and set inode attribute */
+    struct a1fs_inode *new_inode = inode_at(fs, new_ino);
+    memset(new_inode, 0, sizeof(*new_inode));
+    new_inode->mode  = mode;
+    new_inode->links = links;
+    new_inode->size  = 0;
+    // Directories start out with no blocks instead (see A1FS_INODE_INLINE_DATA)
+    if (S_ISREG(mode)) new_inode->flags = A1FS_INODE_INLINE_DATA;
+    if (clock_gettime(CLOCK_REALTIME, &new_inode->mtime) == -1) {
+        perror("clock_gettime");
+        exit(EXIT_FAILURE);
+    }
+
+    /** update parent inode attribute */
+    if (S_ISDIR(mode)) {
+        parent->links += 1;
+    }
+    parent->mtime = new_inode->mtime;
+
+    *ino = new_ino;
+    return 0;
+}
+
+
+/**
+ * Remove the entry of an inode from a directory and drop the link count of
+ * the inode to 0; its contents stay until inode_free(). The caller holds the
+ * locks of both for writing (and has checked that a directory is empty). A
+ * directory left mostly empty is compacted (see dir_tidy()).
+ *
+ * @return  0 on success; -ENOENT if there is no such entry.
+ */
+int node_unlink(fs_ctx *fs, a1fs_ino_t parent_ino, const char *name, struct a1fs_inode *inode) {
+    struct a1fs_inode *parent = inode_at(fs, parent_ino);
+    int ret = dir_remove_entry(fs, parent, name);
+    if (ret != 0) return ret;
+
+    if (S_ISDIR(inode->mode)) {
+        parent->links -= 1;
+    }
+    inode->links = 0;
+    if (clock_gettime(CLOCK_REALTIME, &parent->mtime) == -1) {
+        perror("clock_gettime");
+        exit(EXIT_FAILURE);
+    }
+    dir_tidy(fs, parent_ino);
+    return 0;
+}
+
+
+/**
+ * Free an unlinked inode: its data blocks (or directory index) and then the
+ * inode itself, which may be reused right away. The caller holds the inode
+ * lock for writing.
+ */
+void inode_free(fs_ctx *fs, a1fs_ino_t ino) {
+    struct a1fs_inode *inode = inode_at(fs, ino);
+    if (S_ISDIR(inode->mode)) {
+        dir_index_free(fs, inode);
+    } else {
+        file_shrink(fs, ino, 0);
+    }
+    rm_inode_bitmap(fs, ino);
+}
+
+
+/**
+ * Free the inodes that were unlinked while still open and never released,
+ * e.g. when the driver was stopped without an unmount. Called with no
+ * requests being served.
+ */
+void fs_free_orphans(fs_ctx *fs) {
+    for (size_t ino = bitmap_find_one(&fs->inode_bm, 1); ino < fs->inode_bm.nbits;
+         ino = bitmap_find_one(&fs->inode_bm, ino + 1))
+    {
+        if (inode_at(fs, ino)->links == 0) inode_free(fs, ino);
+    }
+}
+
+
+/**
+ * Find the inode number for an absolute path.
+ *
+ * Results (including "no such file" for a missing last component) are cached
+ * in the fs context, so a repeated lookup costs a single hash probe and a
+ * cache miss only scans the last directory on the path.
+ *
+ * A directory is scanned with its lock held for reading, so the caller must
+ * not hold the lock of a directory on the path.
+ *
+ * @param fs    file system context.
+ * @param path  absolute path.
+ * @param ino   pointer to the variable that receives the inode number.
+ *
+ * @return      0 on success; -ENOENT if a component of the path does not
+ *              exist; -ENOTDIR if a component of the path prefix is not a
+ *              directory; -ENAMETOOLONG if the path or a component is too long.
+ */
+int path_lookup(fs_ctx *fs, const char *path, a1fs_ino_t *ino) {
+    size_t len = strlen(path);
+    if (len >= A1FS_PATH_MAX) return -ENAMETOOLONG;
+    if (path[0] != '/') return -ENOENT;
+
+    // root is not cached; it is always inode 0
+    if (strcmp(path, "/") == 0) {
+        *ino = 0;
+        return 0;
+    }
+
+    bool negative;
+    if (dcache_lookup(fs, path, ino, &negative)) {
+        return negative ? -ENOENT : 0;
+    }
+
+    // split into the parent path and the last component
+    const char *name = strrchr(path, '/') + 1;
+    if (strlen(name) >= A1FS_NAME_MAX) return -ENAMETOOLONG;
+    size_t parent_len = (name - 1 == path) ? 1 : (size_t)(name - 1 - path);
+    char parent_path[parent_len + 1];
+    memcpy(parent_path, path, parent_len);
+    parent_path[parent_len] = '\0';
+
+    a1fs_ino_t parent_ino;
+    int ret = path_lookup(fs, parent_path, &parent_ino);
+    if (ret != 0) return ret;
+
+    struct a1fs_inode *parent = inode_at(fs, parent_ino);
+    inode_rdlock(fs, parent_ino);
+    if ((parent->mode & S_IFMT) != S_IFDIR) {
+        inode_unlock(fs, parent_ino);
+        return -ENOTDIR;
+    }
+
+    struct a1fs_dentry *entry = dir_find_entry(fs, parent, name);
+    if (entry == NULL) {
+        dcache_insert(fs, path, 0, true);
+        inode_unlock(fs, parent_ino);
+        return -ENOENT;
+    }
+    *ino = entry->ino;
+    dcache_insert(fs, path, *ino, false);
+    inode_unlock(fs, parent_ino);
+    return 0;
+}
+
+
+/**
+ * Map the image file and set up the fs context for it. The image file is also
+ * kept open, so that reads can be spliced from it.
+ *
+ * @param fs    file system context to initialize.
+ * @param opts  command line options.
+ * @return      true on success; false on failure.
+ */
+bool fs_mount(fs_ctx *fs, a1fs_opts *opts) {
+    size_t size;
+    void *image = map_file(opts->img_path, A1FS_BLOCK_SIZE, &size);
+    if (!image) return false;
+
+    int fd = open(opts->img_path, O_RDWR);
+    if (fd < 0) {
+        perror(opts->img_path);
+        munmap(image, size);
+        return false;
+    }
+    if (!fs_ctx_init(fs, image, size, opts)) {
+        close(fd);
+        munmap(image, size);
+        return false;
+    }
+    fs->image_fd = fd;
+    return true;
+}
+
+
+/** Release everything set up by fs_mount() (nothing if it wasn't called). */
+void fs_unmount(fs_ctx *fs) {
+    if (fs->image) {
+        munmap(fs->image, fs->size);
+        close(fs->image_fd);
+        fs_ctx_destroy(fs);
+    }
+}
+
+
+/** Get file system statistics (see a1fs_statfs()). */
+void fs_statfs(fs_ctx *fs, struct statvfs *st) {
+    struct a1fs_superblock *sp = (struct a1fs_superblock *)(fs->image);
+
+    memset(st, 0, sizeof(*st));
+    st->f_bsize   = A1FS_BLOCK_SIZE;
+    st->f_frsize  = A1FS_BLOCK_SIZE;
+
+    // a tail of the image too small for a block group is not part of the
+    // file system
+    uint64_t blocks_num = sp->s_blocks_count;
+    uint64_t blocks_usd = __atomic_load_n(&sp->blocks_usd, __ATOMIC_RELAXED);
+    unsigned int inodes_usd = __atomic_load_n(&sp->inodes_usd, __ATOMIC_RELAXED);
+    st->f_blocks  = blocks_num;
+    st->f_bfree   = blocks_num - blocks_usd;
+    st->f_bavail  = blocks_num - blocks_usd;
+    st->f_files   = sp->s_inodes_count;
+    st->f_ffree   = sp->s_inodes_count - inodes_usd;
+    st->f_favail  = sp->s_inodes_count - inodes_usd;
+    st->f_namemax = A1FS_NAME_MAX;
+}
+
+
+/**
+ * Negotiate the connection with the kernel (called from the FUSE init()
+ * callback of both drivers).
+ *
+ * Asks for the writeback cache, so that small writes are gathered in the page
+ * cache and sent in large requests, and for readdirplus, so that a listing
+ * also returns the attributes of the entries and "ls -l" doesn't need a
+ * getattr() per entry. Requests of up to max_write bytes are negotiated (FUSE
+ * derives max_pages from it, up to 1 MiB with current kernels).
+ *
+ * @param fs    file system context.
+ * @param conn  connection information; capabilities are enabled in conn->want.
+ */
+void conn_init(fs_ctx *fs, struct fuse_conn_info *conn) {
+    if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    if (conn->capable & FUSE_CAP_READDIRPLUS) conn->want |= FUSE_CAP_READDIRPLUS;
+    conn->max_write = fs->opts->max_write;
+    conn->max_readahead = fs->opts->max_read;
+}
@@ -34,6 +34,8 @@ typedef struct mkfs_opts {
 	const char *img_path;
 	/** Number of inodes. */
 	size_t n_inodes;
+	/** Allocation cluster size in bytes (0 - one block). */
+	size_t cluster_size;
 
 	/** Print help and exit. */
 	bool help;
@@ -41,6 +43,8 @@ typedef struct mkfs_opts {
 	bool force;
 	/** Zero out image contents. */
 	bool zero;
+	/** Use variable-length directory entries. */
+	bool var_dentries;
 
 } mkfs_opts;
 
@@ -55,6 +59,9 @@ Options:\n\
     -h      print help and exit\n\
     -f      force format - overwrite existing a1fs file system\n\
     -z      zero out image contents\n\
+    -d      use compact variable-length directory entries\n\
+    -c size cluster size in bytes - a power of 2 multiple of the block\n\
+            size, up to 1 MiB; data blocks are allocated in clusters\n\
 ";
 
 static void print_help(FILE *f, const char *progname)
@@ -66,13 +73,15 @@ static void print_help(FILE *f, const char *progname)
 static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 {
 	char o;
-	while ((o = getopt(argc, argv, "i:hfvz")) != -1) {
+	while ((o = getopt(argc, argv, "i:c:hfvzd")) != -1) {
 		switch (o) {
 			case 'i': opts->n_inodes = strtoul(optarg, NULL, 10); break;
+			case 'c': opts->cluster_size = strtoul(optarg, NULL, 10); break;
 
 			case 'h': opts->help  = true; return true;// skip other arguments
 			case 'f': opts->force = true; break;
 			case 'z': opts->zero  = true; break;
+			case 'd': opts->var_dentries = true; break;
 
 			case '?': return false;
 			default : assert(false);
@@ -89,6 +98,14 @@ static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 		fprintf(stderr, "Missing or invalid number of inodes\n");
 		return false;
 	}
+	if ((opts->cluster_size != 0) &&
+	    ((opts->cluster_size < A1FS_BLOCK_SIZE) ||
+	     (opts->cluster_size > ((size_t)A1FS_BLOCK_SIZE << A1FS_MAX_LOG_CLUSTER_SIZE)) ||
+	     ((opts->cluster_size & (opts->cluster_size - 1)) != 0)))
+	{
+		fprintf(stderr, "Invalid cluster size\n");
+		return false;
+	}
 	return true;
 }
 
@@ -106,6 +123,15 @@ static bool a1fs_is_present(void *image){
 
 
 
+/** Set bits [from, from + count) of a bitmap in the image (bit 0 is the most significant bit of byte 0). */
+static void set_bits(unsigned char *bits, unsigned int from, unsigned int count)
+{
+	for (unsigned int i = from; i < from + count; i++) {
+		bits[i / 8] |= 1 << (7 - i % 8);
+	}
+}
+
+
 /**
  * Format the image into a1fs.
  *
@@ -123,25 +149,89 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	//NOTE: the mode of the root directory inode should be set to S_IFDIR | 0777
 	
 	//struct timespec start; 
-	const unsigned int num_blocks = (size%A1FS_BLOCK_SIZE == 0) ? size/A1FS_BLOCK_SIZE : size/A1FS_BLOCK_SIZE + 1;
+	a1fs_blk_t num_blocks = (size%A1FS_BLOCK_SIZE == 0) ? size/A1FS_BLOCK_SIZE : size/A1FS_BLOCK_SIZE + 1;
 	const unsigned int num_inodes = opts->n_inodes;
-	const unsigned int inode_blocks = (num_inodes*64%A1FS_BLOCK_SIZE == 0) ? num_inodes*64/A1FS_BLOCK_SIZE : num_inodes*64/A1FS_BLOCK_SIZE + 1;
+	const unsigned int inodes_per_block = A1FS_BLOCK_SIZE / sizeof(a1fs_inode);
+
+	// With bigalloc, the data bitmaps track clusters of 2^cb blocks; each
+	// group keeps the same number of bitmap bits, so it spans more blocks.
+	// Metadata is marked in whole clusters, and a partial last cluster of
+	// the image is left out.
+	unsigned int cb = 0;
+	while ((opts->cluster_size != 0) && ((size_t)A1FS_BLOCK_SIZE << cb) < opts->cluster_size) cb++;
+	const unsigned int cluster = 1u << cb;
+	num_blocks = num_blocks / cluster * cluster;
+#define CLUSTERS(n) (((n) + cluster - 1) / cluster * cluster)
+
+	// Split the image into block groups. A last group too small for its
+	// metadata and at least one data cluster is left out of the file system.
+	const unsigned int bpg = A1FS_BLOCKS_PER_GROUP << cb;
+	unsigned int ngroups, gdt_blocks, ipg, itable_blocks;
+	for (;;) {
+		ngroups = (num_blocks + bpg - 1) / bpg;
+		gdt_blocks = (ngroups * sizeof(a1fs_group_desc) + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE;
+		// a multiple of 256 keeps the bitmap segments aligned to whole words
+		ipg = ((num_inodes + ngroups - 1) / ngroups + 255) / 256 * 256;
+		itable_blocks = ipg / inodes_per_block;
+		unsigned int last_meta = CLUSTERS(((ngroups == 1) ? 1 + gdt_blocks : 0) + 2 + itable_blocks);
+		if ((ngroups == 1) || (num_blocks - (a1fs_blk_t)(ngroups - 1) * bpg > last_meta)) break;
+		num_blocks = (a1fs_blk_t)(ngroups - 1) * bpg;
+	}
+	if (ipg > A1FS_BLOCKS_PER_GROUP) {
+		fprintf(stderr, "Too many inodes for the image size\n");
+		return false;
+	}
+	// group 0 metadata, plus the root directory index in the next cluster
+	const unsigned int meta0 = 1 + gdt_blocks + 2 + itable_blocks;
+	const unsigned int root_blk = CLUSTERS(meta0);
+	if (root_blk + CLUSTERS(2) > bpg) {
+		fprintf(stderr, "Image is too large\n");
+		return false;
+	}
+	if (num_blocks < root_blk + CLUSTERS(2)) {
+		fprintf(stderr, "Image is too small for %u inodes\n", num_inodes);
+		return false;
+	}
 
 	struct a1fs_superblock *sp = (struct a1fs_superblock *)(image);
 	sp->magic = A1FS_MAGIC;
 	sp->size = size;
-	sp->s_inodes_count = num_inodes;
+	sp->s_inodes_count = ipg * ngroups;
 	sp->s_blocks_count = num_blocks;
-	sp->inodes_usd = 1;
-	sp->blocks_usd = 3+inode_blocks;
-	sp->s_first_data_block = A1FS_BLOCK_SIZE*(inode_blocks+3);
-	sp->s_first_inode = A1FS_BLOCK_SIZE*3;
-	sp->data_bitmap_pt = A1FS_BLOCK_SIZE*1;
-	sp->inode_bitmap_pt = A1FS_BLOCK_SIZE*2;
-	sp->datablocks_count = num_blocks - (inode_blocks+3);
-
+	sp->inodes_usd = 0;
+	sp->blocks_usd = 0;
+	sp->s_first_data_block = 0;
+	sp->datablocks_count = num_blocks;
+	sp->s_groups_count = ngroups;
+	sp->s_blocks_per_group = bpg;
+	sp->s_inodes_per_group = ipg;
+	sp->s_group_desc_blk = 1;
+	sp->s_features = A1FS_FEATURE_BLOCK_GROUPS | A1FS_FEATURE_64BIT | (opts->var_dentries ? A1FS_FEATURE_VAR_DENTRY : 0);
+	sp->s_log_cluster_size = cb;
+	if (cb != 0) sp->s_features |= A1FS_FEATURE_BIGALLOC;
+
+	// lay out the metadata at the start of each group: the block bitmap, the
+	// inode bitmap and the inode table (after the superblock and the group
+	// descriptor table in group 0), starting from empty bitmaps and inode tables
+	a1fs_group_desc *gdt = (a1fs_group_desc *)(image + sp->s_group_desc_blk * A1FS_BLOCK_SIZE);
+	memset(gdt, 0, A1FS_BLOCK_SIZE * gdt_blocks);
+	for (unsigned int g = 0; g < ngroups; g++) {
+		a1fs_blk_t first = (a1fs_blk_t)g * bpg;
+		unsigned int blocks = (g == ngroups - 1) ? num_blocks - first : bpg;
+		unsigned int meta = (g == 0) ? meta0 : 2 + itable_blocks;
+		gdt[g].block_bitmap = first + meta - itable_blocks - 2;
+		gdt[g].inode_bitmap = gdt[g].block_bitmap + 1;
+		gdt[g].inode_table = gdt[g].inode_bitmap + 1;
+		memset(image + (size_t)gdt[g].block_bitmap * A1FS_BLOCK_SIZE, 0, A1FS_BLOCK_SIZE * (2 + itable_blocks));
+
+		unsigned char *block_bits = image + (size_t)gdt[g].block_bitmap * A1FS_BLOCK_SIZE;
+		set_bits(block_bits, 0, CLUSTERS(meta) >> cb);
+		gdt[g].free_blocks = blocks - CLUSTERS(meta);
+		gdt[g].free_inodes = ipg;
+		sp->blocks_usd += CLUSTERS(meta);
+	}
 
-	struct a1fs_inode *root_inode = (struct a1fs_inode *)(image + A1FS_BLOCK_SIZE * 3); 
+	struct a1fs_inode *root_inode = (struct a1fs_inode *)(image + (size_t)gdt[0].inode_table * A1FS_BLOCK_SIZE); 
 	root_inode->links = 2;
 	root_inode->size = 0;
 	root_inode->mode = S_IFDIR | 0777;
@@ -154,9 +244,22 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 
 
 	// update root inode bitmap
-	unsigned char *inode_bits = (unsigned char *)(image + A1FS_BLOCK_SIZE * 2);
-	inode_bits[0] |= (1<<7);
+	set_bits(image + (size_t)gdt[0].inode_bitmap * A1FS_BLOCK_SIZE, 0, 1);
+	gdt[0].free_inodes--;
 	sp->inodes_usd = 1;
+
+	// create an empty hashed index for the root directory in the first two
+	// free blocks of group 0: the header and one block of buckets
+	struct a1fs_dir_index *root_index = (struct a1fs_dir_index *)(image + (size_t)root_blk * A1FS_BLOCK_SIZE);
+	memset(root_index, 0, A1FS_BLOCK_SIZE * 2);
+	root_index->magic = A1FS_DIR_INDEX_MAGIC;
+	root_index->nbuckets = A1FS_DIR_BUCKETS_PER_BLOCK;
+	root_inode->index_pt = root_blk;
+	root_inode->index_blocks = 2;
+	set_bits(image + (size_t)gdt[0].block_bitmap * A1FS_BLOCK_SIZE, root_blk >> cb, CLUSTERS(2) >> cb);
+	gdt[0].free_blocks -= CLUSTERS(2);
+	sp->blocks_usd += CLUSTERS(2);
+#undef CLUSTERS
 	return true;
 }
 
@@ -31,19 +31,44 @@
 static const struct fuse_opt opt_spec[] = {
 	A1FS_OPT("-h"    , help),
 	A1FS_OPT("--help", help),
+	// Noted here and still passed on to FUSE
+	A1FS_OPT("-s"    , single_thread),
+	FUSE_OPT_KEY("-s", FUSE_OPT_KEY_KEEP),
+	{ "dcache_size=%u", offsetof(a1fs_opts, dcache_size), 0 },
+	A1FS_OPT("dcache_stats", dcache_stats),
+	{ "max_read=%u"   , offsetof(a1fs_opts, max_read   ), 0 },
+	{ "max_write=%u"  , offsetof(a1fs_opts, max_write  ), 0 },
+	{ "entry_timeout=%lf"   , offsetof(a1fs_opts, entry_timeout   ), 0 },
+	{ "attr_timeout=%lf"    , offsetof(a1fs_opts, attr_timeout    ), 0 },
+	{ "negative_timeout=%lf", offsetof(a1fs_opts, negative_timeout), 0 },
+	A1FS_OPT("kernel_cache", kernel_cache),
+	A1FS_OPT("auto_cache"  , auto_cache),
 	FUSE_OPT_END
 };
 
 static const char *help_str = "\
 Usage: %s image mountpoint [options]\n\
 \n\
-Mount a1fs image file under mount point directory. Use fusermount(1) to \n\
-unmount. Only single-threaded mount is supported; -s FUSE option is implied.\n\
+Mount a1fs image file under mount point directory. Use fusermount3(1) to \n\
+unmount. Requests are served by multiple threads unless -s is given.\n\
+Zero-copy reads (file data spliced straight from the image) need -s with\n\
+a1fs; with more threads its reads copy the data. a1fs_ll always uses them.\n\
 \n\
 general options:\n\
     -o opt,[opt...]        mount options\n\
     -h   --help            print help\n\
 \n\
+a1fs options:\n\
+    -o dcache_size=N       number of path lookup cache slots (default 4096)\n\
+    -o dcache_stats        print lookup cache hits and misses on unmount\n\
+    -o max_read=N          largest read ahead in bytes (default 1048576)\n\
+    -o max_write=N         largest write request in bytes (default 1048576)\n\
+    -o entry_timeout=T     seconds the kernel caches names (default 1.0)\n\
+    -o attr_timeout=T      seconds the kernel caches attributes (default 1.0)\n\
+    -o negative_timeout=T  seconds the kernel caches missing names (default 0)\n\
+    -o kernel_cache        keep file data cached across opens\n\
+    -o auto_cache          keep file data cached unless the file changed\n\
+\n\
 ";
 
 // Callback for fuse_opt_parse()
@@ -62,25 +87,28 @@ static int opt_proc(void *data, const char *arg, int key, struct fuse_args *out)
 
 bool a1fs_opt_parse(struct fuse_args *args, a1fs_opts *opts)
 {
+	// 0 is a valid timeout, so the defaults go in before parsing
+	opts->entry_timeout = A1FS_DEFAULT_ENTRY_TIMEOUT;
+	opts->attr_timeout = A1FS_DEFAULT_ATTR_TIMEOUT;
+	opts->negative_timeout = A1FS_DEFAULT_NEGATIVE_TIMEOUT;
 	if (fuse_opt_parse(args, opts, opt_spec, opt_proc) != 0) return false;
 
 	//NOTE: printing to stderr to keep it consistent with FUSE
 	if (opts->help) {
 		fprintf(stderr, help_str, args->argv[0]);
-		fuse_opt_add_arg(args, "-ho");
+		// Have FUSE print its own options, without repeating the usage line
+		fuse_opt_add_arg(args, "--help");
+		args->argv[0][0] = '\0';
 	}
 	if (!opts->help && !opts->img_path) {
 		fprintf(stderr, "Missing image path\n");
 		return false;
 	}
 
-	// Only single-threaded mount is supported
-	fuse_opt_add_arg(args, "-s");
-	// Limit the size of reads and writes to 4K
-	fuse_opt_add_arg(args, "-o");
-	fuse_opt_add_arg(args, "max_read=4096");
-	fuse_opt_add_arg(args, "-o");
-	fuse_opt_add_arg(args, "max_write=4096");
+	// Reads and writes can span any number of blocks; the request sizes are
+	// negotiated with the kernel in the init() callback (see conn_init())
+	if (opts->max_read == 0) opts->max_read = A1FS_DEFAULT_MAX_READ;
+	if (opts->max_write == 0) opts->max_write = A1FS_DEFAULT_MAX_WRITE;
 
 	return true;
 }
@@ -23,12 +23,44 @@
 #include <fuse_opt.h>
 
 
+/** Default largest read ahead in bytes. */
+#define A1FS_DEFAULT_MAX_READ (1024 * 1024)
+/** Default largest write request in bytes. */
+#define A1FS_DEFAULT_MAX_WRITE (1024 * 1024)
+/** Default time in seconds the kernel may cache a name. */
+#define A1FS_DEFAULT_ENTRY_TIMEOUT 1.0
+/** Default time in seconds the kernel may cache attributes. */
+#define A1FS_DEFAULT_ATTR_TIMEOUT 1.0
+/** Default time in seconds the kernel may cache that a name doesn't exist. */
+#define A1FS_DEFAULT_NEGATIVE_TIMEOUT 0.0
+
+
 /** a1fs command line options. */
 typedef struct a1fs_opts {
 	/** a1fs image file path. */
 	const char *img_path;
 	/** Print help and exit. FUSE option. */
 	int help;
+	/** Serve requests from a single thread. FUSE option. */
+	int single_thread;
+	/** Number of path lookup cache slots; 0 selects the default. */
+	unsigned int dcache_size;
+	/** Print path lookup cache hit and miss counts on unmount. */
+	int dcache_stats;
+	/** Largest read ahead in bytes; 0 selects the default. */
+	unsigned int max_read;
+	/** Largest write request in bytes; 0 selects the default. */
+	unsigned int max_write;
+	/** Time in seconds the kernel may cache a name. */
+	double entry_timeout;
+	/** Time in seconds the kernel may cache attributes. */
+	double attr_timeout;
+	/** Time in seconds the kernel may cache that a name doesn't exist. */
+	double negative_timeout;
+	/** Keep file data in the page cache across opens. */
+	int kernel_cache;
+	/** Keep file data in the page cache across opens unless the file changed. */
+	int auto_cache;
 
 } a1fs_opts;
 
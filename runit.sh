@@ -23,7 +23,7 @@ echo ----------------------------;
 echo "Unmount";
 # unmount the image
 cd ..;
-fusermount -u /tmp/chenxuyu;
+fusermount3 -u /tmp/chenxuyu;
 # mount the image again and display some contents of the file system to show that the relevant state was saved to the disk image.
 echo ----------------------------;
 echo "Remount";
@@ -33,5 +33,5 @@ cd /tmp/chenxuyu;
 # display all attributes of files and directories
 ls -al;
 cd ..;
-fusermount -u /tmp/chenxuyu;
+fusermount3 -u /tmp/chenxuyu;
 cd ~/a1b;
\ No newline at end of file